@@ -7,10 +7,8 @@
     ----------------------------
     string comparison
     arrays
-    variable linkage
     ON ERROR
     file I/O
-    load and save
     low-power sleep
     time and date
     INKEY$
@@ -26,6 +24,11 @@
 #include <stdio.h>
 #include <limits.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
  *  The BASIC parser takes input lines and outputs a tree of
@@ -34,27 +37,49 @@
  *  general and sort of one-size-does-everything, so they have
  *  a lot of fields. Most of these fields are usually empty,
  *  somewhat the same as toy Legos often having "bumps" that
- *  aren't covered by other Legos.
+ *  aren't covered by other Legos. The flags sit right after
+ *  'what', in what would otherwise be padding.
+ *
+ *  The children come last, and a lego has room for only as many as
+ *  its kind can have ('args', from lego_args() in image.c), so a
+ *  number or variable takes 40 bytes on 64-bit machines, not 72.
+ *  Pointers stay pointers, since nearly everything reaches children
+ *  as l -> a[i]; arenas (util.c) keep each line's legos together,
+ *  which is most of what pools of indexed nodes would give.
  */
 enum { max_args = 4 };
 
 typedef struct lego {
     int what;           // w-enum
+    char lit_delim;     // alternate delimiter for string literal
+    unsigned char args; // room in a[] (only that much is there)
+    unsigned char force_parens : 1; // print parens around this lego
+    unsigned char list_delim : 1;   // comma (0) or semicolon (1) for PRINT
+    unsigned char abbrev : 1;       // abbreviate PRINT or REM to ? or '
     double n;           // number (if any)
     char *s;            // string (if any)
-    void *link;         // linked pointer (to line or var)
-    char force_parens;  // print parens around this lego
-    char lit_delim;     // alternate delimiter for string literal
-    char list_delim;    // comma (0) or semicolon (1) for PRINT
-    char abbrev;        // abbreviate PRINT or REM to ? or '
+    void *link;         // linked pointer (to line or var, or folded value)
+    struct lego *next;  // for lists of expressions, line #s, etc.
     struct lego 
         *a[max_args];   // sub-lego arguments, parameters, etc.
-    struct lego *next;  // for lists of expressions, line #s, etc.
 } lego;
 
+/*
+ *  How variables are stored. Each variable has one of these slots,
+ *  found through the variable's lego 'link' once linked.
+ */
+typedef struct varDB {
+    char *name;
+    char *s;
+    double n;
+    int era;            // assigned iff this is vars_era
+    unsigned hash;      // of name and type, for the symbol table
+    int string;         // string (not numeric) variable
+} varDB;
+
 /*
  *  This is how a computed result from an expression is returned.
- *  Whoever owns this typedef needs to free 's' when done.
+ *  Whoever owns this typedef needs to drop 's' when done.
  */
 typedef struct {
     enum { rNum = -1, rExcept = 0, rString = 1 } what;
@@ -73,37 +98,84 @@ enum {
     wGT, wGE, wLT, wLE, wEQ, wNE,  
     wAND, wOR, wXOR, wEQV, wIMP, wNAND, wNOR, END_BINARY_GUYS,
 
-    wABS, wASC, wATAN, wCHR, wCOS, wEXP, wFIX, wINSTR, wINT,
-    wLEFT, wLEN, wLOG, wMID, wRIGHT, wRND, wSGN, wSIN, wSPACE,
+    wABS, wASC, wATAN, wCHR, wCOS, wEXP, wFIX, wFRE, wFREMEM, wINSTR,
+    wINT, wLEFT, wLEN, wLOG, wMID, wRIGHT, wRND, wSGN, wSIN, wSPACE,
     wSQRT, wSTR, wSTRING, wTAN, wVAL, END_FUNCTION_GUYS,
 
     wNEW, wEND, wSTOP, wCONT, wRETURN, wCLS, wLIST, wDEL, wGOSUB, wGOTO, 
     wRUN, wRESTORE, wONGOTO, wONGOSUB, wREM, wFOR, wNEXT, wREAD, wDATA, 
-    wPRINT, wINPUT, wIF, wLET, wLINEINPUT, wALTER, wONALTER, END_STATEMENT_GUYS,
+    wPRINT, wINPUT, wIF, wLET, wLINEINPUT, wALTER, wONALTER, wDISASM,
+    wLOAD, wSAVE, wCLEAR, wMEM, END_STATEMENT_GUYS,
 
     wKLUDGE, wSTRLIT, wSTRVAR, wNUMLIT, wNUMVAR, wLINENUM,
     wNUMBEREDLINE, wERROR,
 
+    /* opcodes that only the VM uses; see compile.c */
+    wJUMP, wJFALSE, wSETNUM, wSETSTR, wPRINTNUM, wPRINTSTR, wPRINTSEP,
+    wHALT, wDUP, wCATN, wAPPEND, END_VM_GUYS,
+
 #define GUYS \
     "o.unused", "-", "NOT ", "e.un", \
     "+", "^", "*", "/", "+", "-", \
     "\\", "MOD", ">", ">=", "<", "<=", "=", "<>", \
     "AND", "OR", "XOR", "EQV", "IMP", "NAND", "NOR", "e.bin", \
-    "ABS", "ASC", "ATAN", "CHR$", "COS", "EXP", "FIX", "INSTR", "INT", \
-    "LEFT$", "LEN", "LOG", "MID$", "RIGHT$", "RND", "SGN", "SIN", "SPACE$", \
-    "SQRT", "STR$", "STRING$", "TAN", "VAL", "e.fun", \
+    "ABS", "ASC", "ATAN", "CHR$", "COS", "EXP", "FIX", "FRE", "FRE", \
+    "INSTR", "INT", "LEFT$", "LEN", "LOG", "MID$", "RIGHT$", "RND", "SGN", \
+    "SIN", "SPACE$", "SQRT", "STR$", "STRING$", "TAN", "VAL", "e.fun", \
     "NEW", "END", "STOP", "CONT", "RETURN", "CLS", "LIST", "DEL", "GOSUB", \
     "GOTO", "RUN", "RESTORE", "ONGOTO", "ONGOSUB", "REM", "FOR", "NEXT", \
     "READ", "DATA", "PRINT", "INPUT", "IF", "LET", "LINEINPUT", "ALTER", \
-    "ONALTER", "e.st", "o.kludge", "o.strlit", "o.strvar", "o.numlit", \
-    "o.numvar", "o.linenum", "o.numberedline", "o.error"
+    "ONALTER", "DISASM", "LOAD", "SAVE", "CLEAR", "MEM", "e.st", "o.kludge", \
+    "o.strlit", "o.strvar", "o.numlit", "o.numvar", "o.linenum", \
+    "o.numberedline", "o.error", \
+    "v.jump", "v.jfalse", "v.setnum", "v.setstr", "v.printnum", \
+    "v.printstr", "v.printsep", "v.halt", "v.dup", "v.catn", "v.append"
 };
 
+/*
+ *  The compiler lowers legos into a flat array of these for the VM.
+ *  Each instruction is an opcode followed by its operands (see
+ *  operands() in compile.c). Opcodes are 'what' values while being
+ *  compiled, then are threaded into label addresses within execute().
+ *  A header word comes first, saying how deep the stacks can get.
+ */
+typedef union code {
+    void *op;           // threaded opcode
+    int i;              // unthreaded opcode or small integer
+    double n;           // numeric literal
+    char *s;            // string literal (owned by a lego)
+    lego *l;            // line reference or list
+    varDB *v;           // variable
+    union code *j;      // jump target
+} code;
+
+/* compile.c */
+void fold(lego *l);
+code *compile(lego *l);
+void disassemble(code *c, double vi, double de);
+
+/* image.c */
+int save_image(char *name, lego **lines, int count);
+int is_image(char *map, long size);
+int load_image(char *map, long size, lego **result);
+int lego_args(int what);
+
 /* eval.c */
+extern int vars_era;
 void erase_run_vars(void);
+void free_vars(void);
+varDB *bind_var(char *name, int string);
 computed evalloc(lego *l);
-void set_var(char *name, char *s, double n);
-double num_from_name_hack(char *name);
+int evalnum(lego *l, double *n);
+computed builtin(int what, computed x, computed y, computed z);
+int boolean_logic(double x, double y, int what, double *res);
+int divmod(double x, double y, int what, double *res);
+int string_valued(int what);
+double csprng(double x);
+void set_var(varDB *v, char *s, double n);
+void give_var(varDB *v, char *s);
+void clear_vars(void);
+void each_var_str(void (*fn)(char **s));
 
 /* parser.c */
 int nothingMore(char **s);
@@ -119,23 +191,74 @@ extern char *guys[];
 void printLego(lego *l);
 
 /* run.c */
+extern int max_depth;
+extern int compact;
 int immediate(lego *l);
 void erase_program(void);
+int load_file(char *name);
+void **opcode_labels(void);
+
+/* strings.c */
+char *new_str(int len);
+char *program_str(int len);
+char *make_str(int len);
+void store_str(char **to, char *s);
+char *keep_str(char *s);
+int str_len(char *s);
+char *share_str(char *s);
+void drop_str(char *s);
+void collect_strs(void);
+int str_space(int bytes);
+int str_spaced(void);
+int str_free(void);
+char *append_str(char *s, char *t, int n);
+char *char_str(int c);
+char *run_str(int c, int n);
+void free_runs(void);
+char *substr(char *s, int from, int upto);
+
+/* tokens.c */
+char *tokenize(lego *l);
+lego *untokenize(char *t);
+void free_tokens(void);
 
 /* util.c */
 extern int Mallocs, Frees;
+enum { mProgram, mVars, mStrings, mStacks, mSpare, mTotal };
+extern long mem_now[], mem_peak[];
+void mem_count(int part, long bytes);
+void mem_report(void);
+extern int writes;
 extern int ctrl_c;
 extern FILE *urandom;
 extern char *warning;
 char *copySubstring(char *from, char *upto);
+typedef struct arena arena;
+extern arena *lego_arena;
+arena *new_arena(void);
+void end_arena(arena *a);
+void keep_arena(arena *a);
+void drop_arena(arena *a);
+void keep_line(lego *line);
+void drop_line(lego *line);
+void free_blocks(void);
 lego *newLego(int what);
+lego *reLego(lego *l, int what);
 void byeLego(lego *tree);
 int main(int argc, char **argv);
 void warn(char *why);
 void flash(int style);
+void flush(void);
+void out_mem(char *s, int n);
+void out_str(char *s);
+void outf(char *fmt, ...);
+void out_num(double n);
+enum { num_room = 32 };     /* bytes num_text() needs */
+char *num_text(double n, char *buf);
 void *getmem(int bytes);
 char *read_line(void);
 
 #define ifnot(x) if (!(x))
 #define zap(x) { if (x) { free(x); ++Frees; (x) = NULL; } }
+#define zap_str(x) { if (x) { drop_str(x); (x) = NULL; } }
 #define tr(x) { fprintf(stderr, "%s", #x); }
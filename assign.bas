@@ -0,0 +1,9 @@
+10 ' string assignment should allocate at most once per new value (and
+20 ' a few more besides), by FRE(-1), the count of allocations so far
+30 N = 10000
+40 A$ = []: B$ = []: M = FRE(-1)
+50 FOR I = 1 TO N: A$ = STR$(I) + [!]: B$ = A$: NEXT
+60 READ C$: DATA [read]
+70 M = FRE(-1) - M
+80 PRINT A$; [ ]; C$; [: ]; M / N; [ allocations per value]
+90 IF M <= N + 10 THEN PRINT [PASS] ELSE PRINT [FAIL]
@@ -0,0 +1,574 @@
+/*
+    Dayton Dynamic BASIC
+    bytecode compiler
+    MWA 2018
+*/
+
+#include "all.h"
+
+/*
+ *  Walking a lego tree costs a recursive call and a returned 'computed'
+ *  for every node, which is most of the time spent in a tight loop. So
+ *  once a program is linked, it is lowered here into one flat array of
+ *  code words that execute() in run.c runs from top to bottom.
+ *
+ *  Values travel on two explicit stacks, one for numbers and one for
+ *  strings. The parser has already made sure of every expression's
+ *  type, so each opcode knows which stack(s) it pops and pushes, and
+ *  nothing on a stack needs a type tag.
+ */
+
+static code *buf;       /* code being compiled */
+static int used, size;  /* words used and allocated within 'buf' */
+static int depth;       /* values on the VM stacks at this point */
+static int deepest;     /* most values on them at any point */
+
+/*
+ *  Describe the operands that follow an opcode, one letter apiece:
+ *
+ *      n   number              s   string literal
+ *      v   variable slot       g   line reference lego (wLINENUM)
+ *      L   list of legos       r   line range (two wLINENUM legos)
+ *      j   jump target         i   small integer
+ *      l   statement lego (not shown)
+ *
+ *  Legos named by operands belong to the program (or immediate line),
+ *  so the code must be thrown away whenever that changes. Variable
+ *  slots are taken from the links that link() made.
+ */
+static char *operands(int what)
+{
+    switch (what) {
+        case wNUMLIT:
+            return "n";
+        case wSTRLIT:
+            return "s";
+        case wNUMVAR:
+        case wSTRVAR:
+        case wSETNUM:
+        case wSETSTR:
+        case wFOR:
+        case wNEXT:
+        case wLINEINPUT:
+            return "v";
+        case wNUMBEREDLINE:
+        case wGOTO:
+        case wGOSUB:
+        case wRUN:
+        case wRESTORE:
+            return "g";
+        case wONGOTO:
+        case wONGOSUB:
+        case wREAD:
+            return "L";
+        case wLIST:
+        case wDEL:
+        case wDISASM:
+            return "r";
+        case wINPUT:
+            return "sL";
+        case wALTER:
+            return "gg";
+        case wONALTER:
+            return "gL";
+        case wJUMP:
+        case wJFALSE:
+            return "j";
+        case wLOAD:
+            return "l";
+        case wPRINTSEP:
+        case wCATN:
+        case wCLEAR:
+            return "i";
+        case wAPPEND:
+            return "vi";
+    }
+    return "";
+}
+
+/*
+ *  Append a word to the code, returning its index.
+ */
+static int emit(code word)
+{
+    if (!buf)
+        buf = getmem((size = 64) * sizeof(code));
+    else if (used == size) {
+        buf = realloc(buf, (size *= 2) * sizeof(code));
+        if (!buf) {
+            outf("out of memory\n");
+            exit(1);
+        }
+    }
+
+    buf[used] = word;
+    return used++;
+}
+
+/*
+ *  Append an opcode, and note how it changes the depth of the stacks.
+ */
+static void op(int what, int pushes)
+{
+    emit((code) { .i = what });
+    depth += pushes;
+    if (depth > deepest)
+        deepest = depth;
+}
+
+/*
+ *  Tell the literal lego an expression always has the value of, if any.
+ */
+static lego *constant(lego *l)
+{
+    if (l -> what == wNUMLIT || l -> what == wSTRLIT)
+        return l;
+    if (l -> what < END_FUNCTION_GUYS)
+        return l -> link;
+    return NULL;
+}
+
+/*
+ *  Fold constant subexpressions within a newly parsed line, so they
+ *  are worked out once rather than every time they run. An operator
+ *  lego whose arguments are all constant gets a literal lego of its
+ *  value hung on its 'link', which LIST never looks at. Operations
+ *  that would fail are left alone to report their errors when run.
+ */
+void fold(lego *l)
+{
+    enum { max_folded = 255 };  /* longest string worth keeping */
+    computed arg[3] = { { 0 } }, q;
+    char *was;
+    lego *k;
+    int i, n;
+
+    for (; l; l = l -> next) {
+        for (i=0; i<l -> args; i++)
+            if (l -> a[i])
+                fold(l -> a[i]);
+
+        if (l -> what >= END_FUNCTION_GUYS || l -> what == wRND
+                || l -> what == wFRE || l -> what == wFREMEM || l -> link)
+            continue;
+        for (n = 0; n < l -> args && l -> a[n] && (k = constant(l -> a[n]));
+                n++) {
+            arg[n].what = k -> what == wSTRLIT ? rString : rNum;
+            arg[n].n = k -> n;
+            arg[n].s = k -> s;
+        }
+        if (n < l -> args && l -> a[n])
+            continue;
+
+        /* Integer division by zero traps, so always leave it be. */
+        if ((l -> what == wIDIV || l -> what == wMOD) && !(int) arg[1].n)
+            continue;
+
+        was = warning;
+        q = builtin(l -> what, arg[0], arg[1], arg[2]);
+        warning = was;
+        if (q.what == rExcept || q.s && (str_len(q.s) > max_folded
+                || strlen(q.s) != str_len(q.s))) {     /* images hold no \0 */
+            zap_str(q.s);
+            continue;
+        }
+
+        k = newLego(q.what == rString ? wSTRLIT : wNUMLIT);
+        k -> n = q.n;
+        k -> s = q.s ? keep_str(q.s) : NULL;
+        l -> link = k;
+    }
+}
+
+/*
+ *  Tell whether an expression is a numeric literal of a given value.
+ */
+static int is_num(lego *l, double n)
+{
+    l = constant(l);
+    return l && l -> what == wNUMLIT && l -> n == n;
+}
+
+static void expression(lego *l);
+
+/*
+ *  Compile the strings that a chain of CATs joins, left to right, but
+ *  for 'skip' and empty literals. Returns how many of them are atop
+ *  the string stack, starting from 'n' there already. Every so often
+ *  they're joined early, to keep the stack shallow.
+ */
+static int pieces(lego *l, lego *skip, int n)
+{
+    enum { max_pieces = 16 };
+    lego *k;
+
+    if (k = constant(l))
+        l = k;
+    if (l == skip || l -> what == wSTRLIT && !str_len(l -> s))
+        return n;
+    if (l -> what == wCAT)
+        return pieces(l -> a[1], skip, pieces(l -> a[0], skip, n));
+
+    expression(l);
+    if (++n == max_pieces) {
+        op(wCATN, 1 - n);
+        emit((code) { .i = n });
+        n = 1;
+    }
+    return n;
+}
+
+/*
+ *  Find the first string a chain of CATs joins.
+ */
+static lego *leftmost(lego *l)
+{
+    while (l -> what == wCAT && !l -> link)
+        l = l -> a[0];
+    return l;
+}
+
+/*
+ *  Compile an expression, leaving its value atop the appropriate stack.
+ *  Arguments are pushed left to right, so the last is on top.
+ *
+ *  Identities like X+0 and X*1 are dropped, and X^2 becomes a multiply,
+ *  which is much cheaper than pow() and rounds the same. (Higher powers
+ *  multiplied out can differ from pow() in the last bit, so they stay.)
+ *  A chain of CATs is joined all at once.
+ */
+static void expression(lego *l)
+{
+    lego *k;
+    int i;
+
+    if (k = constant(l))
+        l = k;
+
+    switch (l -> what) {
+        case wADD:
+            if (is_num(l -> a[0], 0)) {
+                expression(l -> a[1]);
+                return;
+            }
+        case wSUB:
+            if (is_num(l -> a[1], 0)) {
+                expression(l -> a[0]);
+                return;
+            }
+            break;
+        case wMUL:
+            if (is_num(l -> a[0], 1)) {
+                expression(l -> a[1]);
+                return;
+            }
+        case wDIV:
+            if (is_num(l -> a[1], 1)) {
+                expression(l -> a[0]);
+                return;
+            }
+            break;
+        case wCAT:
+            if ((i = pieces(l, NULL, 0)) > 1) {
+                op(wCATN, 1 - i);
+                emit((code) { .i = i });
+            }
+            return;
+        case wPOWER:
+            if (is_num(l -> a[1], 1)) {
+                expression(l -> a[0]);
+                return;
+            }
+            if (is_num(l -> a[1], 2)) {
+                expression(l -> a[0]);
+                op(wDUP, 1);
+                op(wMUL, -1);
+                return;
+            }
+            break;
+    }
+
+    switch (l -> what) {
+        case wNUMLIT:
+            op(wNUMLIT, 1);
+            emit((code) { .n = l -> n });
+            return;
+        case wSTRLIT:
+            op(wSTRLIT, 1);
+            emit((code) { .s = l -> s });
+            return;
+        case wNUMVAR:
+        case wSTRVAR:
+            op(l -> what, 1);
+            emit((code) { .v = l -> link });
+            return;
+    }
+
+    for (i=0; i<l -> args && l -> a[i]; i++)
+        expression(l -> a[i]);
+    op(l -> what, 1 - i);
+}
+
+/*
+ *  Compile a list of statements, or a list of numbered lines.
+ */
+static void statements(lego *l)
+{
+    lego *loop, *k;
+    int skip, out, n;
+
+    for (; l; l = l -> next) switch (l -> what) {
+
+        case wNUMBEREDLINE:
+            op(wNUMBEREDLINE, 0);
+            emit((code) { .l = l });
+            statements(l -> a[0]);
+            break;
+
+        case wREM:
+        case wDATA:
+            break;          /* nothing to execute */
+
+        case wNEW:
+        case wEND:
+        case wSTOP:
+        case wCONT:
+        case wRETURN:
+        case wCLS:
+        case wMEM:
+            op(l -> what, 0);
+            break;
+
+        case wRUN:
+        case wGOTO:
+        case wGOSUB:
+        case wRESTORE:
+        case wLIST:
+        case wDEL:
+        case wDISASM:
+        case wREAD:
+            op(l -> what, 0);
+            emit((code) { .l = l -> a[0] });
+            break;
+
+        case wLOAD:
+            expression(l -> a[0]);
+            op(wLOAD, -1);
+            emit((code) { .l = l });
+            break;
+
+        case wSAVE:
+            expression(l -> a[0]);
+            op(wSAVE, -1);
+            break;
+
+        case wCLEAR:
+            if (l -> a[0])
+                expression(l -> a[0]);
+            op(wCLEAR, l -> a[0] ? -1 : 0);
+            emit((code) { .i = !!l -> a[0] });  /* else keep the space */
+            break;
+
+        case wLINEINPUT:
+        case wNEXT:
+            op(l -> what, 0);
+            emit((code) { .v = l -> a[0] ? l -> a[0] -> link : NULL });
+            break;
+
+        case wONGOTO:
+        case wONGOSUB:
+            expression(l -> a[0]);
+            op(l -> what, -1);
+            emit((code) { .l = l -> a[1] });
+            break;
+
+        case wPRINT:
+            if (!l -> a[0])
+                op(wPRINT, 0);
+            for (loop = l -> a[0]; loop; loop = loop -> next) {
+                expression(loop);
+                op(string_valued(loop -> what) ? wPRINTSTR : wPRINTNUM, -1);
+                if (!loop -> list_delim) {
+                    op(wPRINTSEP, 0);
+                    emit((code) { .i = !!loop -> next });
+                }
+            }
+            break;
+
+        case wIF:
+            /* Jump targets are indices until the code is threaded. */
+            expression(l -> a[0]);
+            op(wJFALSE, -1);
+            skip = emit((code) { .i = 0 });
+            statements(l -> a[1]);
+            if (l -> a[2]) {
+                op(wJUMP, 0);
+                out = emit((code) { .i = 0 });
+                buf[skip].i = used;
+                statements(l -> a[2]);
+                buf[out].i = used;
+            }
+            else
+                buf[skip].i = used;
+            break;
+
+        case wLET:
+            /* A$ = A$ + ... adds onto A$ where it is. */
+            k = leftmost(l -> a[1]);
+            if (k != l -> a[1] && k -> what == wSTRVAR
+                    && k -> link == l -> a[0] -> link) {
+                n = pieces(l -> a[1], k, 0);
+                op(wAPPEND, -n);
+                emit((code) { .v = k -> link });
+                emit((code) { .i = n });
+                break;
+            }
+            expression(l -> a[1]);
+            op(l -> a[0] -> what == wSTRVAR ? wSETSTR : wSETNUM, -1);
+            emit((code) { .v = l -> a[0] -> link });
+            break;
+
+        case wINPUT:
+            op(wINPUT, 0);
+            emit((code) { .s = l -> a[0] ? l -> a[0] -> s : "? " });
+            emit((code) { .l = l -> a[1] });
+            break;
+
+        case wFOR:
+            expression(l -> a[1]);
+            expression(l -> a[2]);
+            if (l -> a[3])
+                expression(l -> a[3]);
+            else {
+                op(wNUMLIT, 1);
+                emit((code) { .n = 1 });
+            }
+            op(wFOR, -3);
+            emit((code) { .v = l -> a[0] -> link });
+            break;
+
+        case wALTER:
+            op(wALTER, 0);
+            emit((code) { .l = l -> a[0] });
+            emit((code) { .l = l -> a[1] });
+            break;
+
+        case wONALTER:
+            expression(l -> a[0]);
+            op(wONALTER, -1);
+            emit((code) { .l = l -> a[1] });
+            emit((code) { .l = l -> a[2] });
+            break;
+
+        default:
+            warn("unimplemented in compiler");
+    }
+}
+
+/*
+ *  Compile a linked program or immediate line into newly allocated,
+ *  threaded code. The code ends in a v.halt that reports wEND.
+ *  Each wNUMBEREDLINE lego's 'link' is pointed at the line's code,
+ *  which is how GOTO and friends find their way at run time.
+ *  The first word is a header telling how many values the code can
+ *  have on the stacks at once, so execute() can make them that big;
+ *  the code proper starts after it.
+ */
+code *compile(lego *l)
+{
+    void **labels = opcode_labels();
+    code *res;
+    char *kinds;
+    int pc, i, what;
+
+    emit((code) { .i = 0 });    /* header */
+    statements(l);
+    op(wHALT, 0);
+    buf[0].i = deepest;
+
+    /* Thread opcodes, and turn jump indices into pointers. */
+    for (pc = 1; pc < used; pc += 1 + strlen(kinds)) {
+        what = buf[pc].i;
+        kinds = operands(what);
+        for (i=0; kinds[i]; i++)
+            if (kinds[i] == 'j')
+                buf[pc + 1 + i].j = buf + buf[pc + 1 + i].i;
+        if (what == wNUMBEREDLINE)
+            buf[pc + 1].l -> link = buf + pc;
+        buf[pc].op = labels[what];
+    }
+
+    res = buf;
+    buf = NULL, used = size = depth = deepest = 0;
+    return res;
+}
+
+/*
+ *  Show compiled code, optionally limited to a range of line numbers.
+ */
+void disassemble(code *c, double vi, double de)
+{
+    void **labels = opcode_labels();
+    code *start = ++c, *arg;   /* past the header */
+    char *kinds;
+    double lNum = -1;
+    int what, i;
+    lego *loop;
+
+    for (; ; c += 1 + strlen(kinds)) {
+        for (what = 0; labels[what] != c -> op; ++what);
+        kinds = operands(what);
+        if (what == wNUMBEREDLINE)
+            lNum = c[1].l -> n;
+        if (what == wHALT)
+            break;
+        if (vi >= 0 && lNum < vi || de >= 0 && lNum > de)
+            continue;
+
+        outf("%6d  %s", (int) (c - start), guys[what]);
+        if (*kinds && *kinds != 'l')
+            outf("%*s", 16 - (int) strlen(guys[what]), "");
+        for (i=0; kinds[i]; i++) {
+            arg = c + 1 + i;
+            switch (kinds[i]) {
+                case 'n':
+                    outf(" ");
+                    out_num(arg -> n);
+                    break;
+                case 's':
+                    outf(" [%s]", arg -> s);
+                    break;
+                case 'v':
+                    if (arg -> v)
+                        outf(" %s%s", arg -> v -> name,
+                            arg -> v -> string ? "$" : "");
+                    break;
+                case 'g':
+                    if (arg -> l)
+                        outf(" %.0f", arg -> l -> n);
+                    break;
+                case 'L':
+                    for (loop = arg -> l; loop; loop = loop -> next) {
+                        outf(loop == arg -> l ? " " : ", ");
+                        printLego(loop);
+                    }
+                    break;
+                case 'r':
+                    outf(" ");
+                    if (arg -> l -> n >= 0)
+                        outf("%.0f", arg -> l -> n);
+                    outf("-");
+                    if (arg -> l -> next -> n >= 0)
+                        outf("%.0f", arg -> l -> next -> n);
+                    break;
+                case 'j':
+                    outf(" %d", (int) (arg -> j - start));
+                    break;
+                case 'i':
+                    outf(" %d", arg -> i);
+                    break;
+            }
+        }
+        outf("\n");
+    }
+}
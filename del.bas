@@ -0,0 +1,4 @@
+10 ' a line number alone deletes that line, in a file as when typed
+20 PRINT [this line goes]
+30 PRINT [this one stays]
+20
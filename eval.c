@@ -9,16 +9,23 @@
 #include "all.h"
 
 /*
- *  How variables are stored.
+ *  Variable slots are handed out from blocks that never move, so the
+ *  links that link() makes to them stay good for as long as we run.
+ *  An open-addressing hash table indexes the slots by name and type.
  */
-typedef struct varDB {
-    char *name;
-    char *s;
-    double n;
-    struct varDB *next;
-} varDB;
+enum { vars_per_block = 64 };
 
-varDB *strDB, *numDB;
+typedef struct var_block {
+    struct var_block *next;
+    int used;
+    varDB vars[vars_per_block];
+} var_block;
+
+static var_block *blocks;   /* all slots, newest block first */
+static varDB **table;       /* hash index; size is a power of two */
+static int table_size;      /* entries in 'table' */
+static int table_used;      /* entries in use */
+int vars_era = 1;           /* slots assigned in other eras are unassigned */
 
 /*
  *  Provision for random number generation.
@@ -40,88 +47,179 @@ double csprng(double x)
 }
 
 /*
- *  Update or create named variable as stated.
+ *  FNV-1a hash of a variable's name and type.
+ */
+static unsigned hash_var(char *name, int string)
+{
+    unsigned h = 2166136261u ^ string;
+
+    for (; *name; ++name)
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    return h;
+}
+
+/*
+ *  Find where a var is, or belongs, in the hash table.
  */
-void set_var(char *name, char *s, double n)
+static varDB **probe(char *name, unsigned h, int string)
 {
-    varDB **v = s ? &strDB : &numDB;
+    unsigned mask = table_size - 1, i;
+    varDB *v;
 
-    for (; *v; v = &(*v) -> next) {
-        if (!strcmp((*v) -> name, name))
+    for (i = h & mask; v = table[i]; i = (i + 1) & mask)
+        if (v -> hash == h && v -> string == string && !strcmp(v -> name, name))
             break;
-    }
-    if (!*v) {
-        *v = getmem(sizeof(varDB));
-        (*v) -> name = copySubstring(name, NULL);
-    }
+    return &table[i];
+}
+
+/*
+ *  Double the hash table, reinserting slots by their saved hashes.
+ */
+static void grow_table(void)
+{
+    varDB **old = table;
+    int i, old_size = table_size;
+
+    table_size = old_size ? 2 * old_size : 64;
+    table = getmem(table_size * sizeof(varDB *));
+    mem_count(mVars, (long) (table_size - old_size) * sizeof(varDB *));
+    for (i=0; i<old_size; i++)
+        if (old[i])
+            *probe(old[i] -> name, old[i] -> hash, old[i] -> string) = old[i];
+    zap(old);
+}
 
-    if (s) {
-        zap ((*v) -> s);
-        (*v) -> s = copySubstring(s, NULL);
+/*
+ *  Find or create the storage slot for a named variable. The linker
+ *  calls this once per variable reference, so that running code never
+ *  has to look names up. A slot lives until free_vars(), even though
+ *  RUN and NEW make it unassigned again.
+ */
+varDB *bind_var(char *name, int string)
+{
+    unsigned h = hash_var(name, string);
+    var_block *b;
+    varDB **e, *v;
+
+    if (2 * (table_used + 1) > table_size)
+        grow_table();
+    e = probe(name, h, string);
+    if (*e)
+        return *e;
+
+    if (!blocks || blocks -> used == vars_per_block) {
+        b = getmem(sizeof(var_block));
+        mem_count(mVars, sizeof(var_block));
+        b -> next = blocks;
+        blocks = b;
     }
-    else
-        (*v) -> n = n;
+    v = *e = &blocks -> vars[blocks -> used++];
+    ++table_used;
+    v -> name = copySubstring(name, NULL);
+    v -> hash = h;
+    v -> string = string;
+    return v;
 }
 
 /*
- *  Remove all vars.
+ *  Call 'fn' on where each slot keeps its string, so the string space
+ *  collector can find them and point them where they've moved.
  */
-void erase_run_vars(void)
+void each_var_str(void (*fn)(char **s))
 {
-    varDB *next;
+    var_block *b;
+    int i;
 
-    for (; strDB; strDB = next) {
-        next = strDB -> next;
-        zap(strDB -> name);
-        zap(strDB -> s);
-        zap(strDB);
-    }
+    for (b = blocks; b; b = b -> next)
+        for (i=0; i<b -> used; i++)
+            fn(&b -> vars[i].s);
+}
 
-    for (; numDB; numDB = next) {
-        next = numDB -> next;
-        zap(numDB -> name);
-        zap(numDB -> s);
-        zap(numDB);
-    }
+static void drop_var_str(char **s)
+{
+    zap_str(*s);
 }
 
 /*
- *  Find a var.
+ *  Assign to a variable's slot as stated. A string is shared, not
+ *  copied, so it must be a counted one, unless it's a scratch string.
  */
-varDB *find_var(varDB *root, char *name)
+void set_var(varDB *v, char *s, double n)
 {
-    for (; root; root = root -> next)
-        if (!strcmp(name, root -> name))
-            return root;
-    return NULL;
+    if (s)
+        store_str(&v -> s, share_str(s));
+    else
+        v -> n = n;
+    v -> era = vars_era;
 }
 
 /*
- *  Get value of a numeric var that we know exists.
+ *  Assign a string to a variable's slot, handing over the caller's
+ *  reference to it instead of taking another.
  */
-double num_from_name_hack(char *name)
+void give_var(varDB *v, char *s)
 {
-    varDB *v;
+    store_str(&v -> s, s);
+    v -> era = vars_era;
+}
 
-    for (v = numDB; v; v = v -> next)
-        if (!strcmp(name, v -> name))
-            return v -> n;
-    puts("bad hack");
-    exit(1);
+/*
+ *  Make all vars unassigned, letting go of their strings right away, as
+ *  CLEAR does so the string space can be set aside anew.
+ */
+void clear_vars(void)
+{
+    each_var_str(drop_var_str);
+    ++vars_era;
+}
+
+/*
+ *  Make all vars unassigned. This is constant time no matter how many
+ *  there are: a new era begins, and nothing was assigned in it yet.
+ *  Slots stay, so links to them remain good. Any string a slot still
+ *  holds is freed when the slot is next assigned, or by free_vars();
+ *  but with a string space, strings are let go of right away, as
+ *  otherwise the space would stay full of them.
+ */
+void erase_run_vars(void)
+{
+    if (str_spaced())
+        each_var_str(drop_var_str);
+    ++vars_era;
+}
+
+/*
+ *  Remove all vars, slots and all. Nothing may be linked to them.
+ */
+void free_vars(void)
+{
+    var_block *b;
+    int i;
+
+    while (b = blocks) {
+        blocks = b -> next;
+        for (i=0; i<b -> used; i++) {
+            zap_str(b -> vars[i].name);
+            zap_str(b -> vars[i].s);
+        }
+        zap(b);
+        mem_count(mVars, -(long) sizeof(var_block));
+    }
+    zap(table);
+    mem_count(mVars, -(long) table_size * sizeof(varDB *));
+    table_size = table_used = 0;
 }
 
 /*
  *  Boolean arithmetic ensuring reasonable bounds.
  */
-computed boolean_logic(double x, double y, int what)
+int boolean_logic(double x, double y, int what, double *res)
 {
-    computed res = { 0 };
     int xi = x, yi = y;
 
     if (xi != x || yi != y) {
         warn("need integer");
-        res.what = rExcept;
-        return res;
+        return 0;
     }
 
     switch (what) {
@@ -146,23 +244,20 @@ computed boolean_logic(double x, double y, int what)
             xi = ~(xi | yi);
     }
 
-    res.what = rNum;
-    res.n = xi;
-    return res;
+    *res = xi;
+    return 1;
 }
 
 /*
  *  Integer division and modulus with reasonable bounds.
  */
-computed divmod(double x, double y, int what)
+int divmod(double x, double y, int what, double *res)
 {
-    computed res = { 0 };
     int xi = x, yi = y;
 
     if (xi != x || yi != y) {
         warn("need integer");
-        res.what = rExcept;
-        return res;
+        return 0;
     }
 
     switch (what) {
@@ -174,70 +269,18 @@ computed divmod(double x, double y, int what)
             break;
     }
 
-    res.what = rNum;
-    res.n = xi;
-    return res;
+    *res = xi;
+    return 1;
 }
 
 /*
- *  Evaluate a string or numeric expression, returning a newly
- *  allocated string literal or numeric literal.
+ *  Tell whether a lego (or VM opcode) of a given type produces a string.
  */
-computed evalloc(lego *l)
+int string_valued(int what)
 {
-    enum { max_str = 32 };
-    int nargs = 0, i, j, len;
-    int except = 0;
-    char *s;
-    varDB *v;
-    computed q = { 0 }, x = { 0 }, y = { 0 }, z = { 0 };
-
-    /* direct return of numbers and strings */
-    switch (l -> what) {
+    switch (what) {
         case wSTRLIT:
-            q.what = rString;
-            q.s = copySubstring(l -> s, NULL);
-            return q;
-        case wNUMLIT:
-            q.what = rNum;
-            q.n = l -> n;
-            return q;
         case wSTRVAR:
-        case wNUMVAR:
-            v = find_var(l -> what == wSTRVAR ? strDB : numDB, l -> s);
-            if (!v) {
-                warn("no such variable");
-                goto exception;
-            }
-            if (l -> what == wSTRVAR) {
-                q.what = rString;
-                q.s = copySubstring(v -> s, NULL);
-            }
-            else {
-                q.what = rNum;
-                q.n = v -> n;
-            }
-            return q;
-    }
-
-    /* figure out how many args */
-    if (l -> what < END_UNARY_GUYS)
-        nargs = 1;
-    else if (l -> what < END_BINARY_GUYS)
-        nargs = 2;
-    else if (l -> what < END_FUNCTION_GUYS) {
-        for (i=0; i<max_args; i++)
-            if (l -> a[i])
-                ++nargs;
-    }
-    else {
-        warn("unimplemented evalloc");
-        goto exception;
-    }
-
-    /* figure out return type */
-    q.what = rNum;
-    switch (l -> what) {
         case wCHR:
         case wLEFT:
         case wMID:
@@ -246,83 +289,70 @@ computed evalloc(lego *l)
         case wSTR:
         case wSTRING:
         case wCAT:
-            q.what = rString;
+            return 1;
     }
+    return 0;
+}
 
-    /* get parameters as local variables (may have to free) */
-    switch (nargs) {
-        case 3:
-            z = evalloc(l -> a[2]);
-            if (z.what == rExcept)
-                except = 1;
-        case 2:
-            y = evalloc(l -> a[1]);
-            if (y.what == rExcept)
-                except = 1;
-        case 1:
-            x = evalloc(l -> a[0]);
-            if (x.what == rExcept)
-                except = 1;
-    }
-
-    /* roll exceptions up the call stack */
-    if (except)
-        goto exception;
-
-    /* do what we have to do */
-    switch (l -> what) {
+/*
+ *  Apply an operator or built-in function that takes and gives only
+ *  numbers, leaving the result in 'res'. Returns 0 (with a warning) if
+ *  that can't be done.
+ */
+static int arith(int what, double x, double y, double *res)
+{
+    switch (what) {
 
         case wNEGATE:
-            q = evalloc(l -> a[0]);
-            q.n = -q.n;
+            *res = -x;
             break;
 
         case wNOT:
-            q.n = !x.n;
+            *res = !x;
             break;
 
         case wPOWER:
-            q.n = pow(x.n, y.n);
+            *res = pow(x, y);
             break;
 
         case wMUL:
-            q.n = x.n * y.n;
+            *res = x * y;
             break;
 
         case wDIV:
-            q.n = x.n / y.n;
+            *res = x / y;
             break;
 
         case wADD:
-            q.n = x.n + y.n;
+            *res = x + y;
             break;
 
         case wSUB:
-            q.n = x.n - y.n;
+            *res = x - y;
             break;
 
         case wGT:
-            q.n = -(x.n > y.n);
+            *res = -(x > y);
             break;
 
         case wGE:
-            q.n = -(x.n >= y.n);
+            *res = -(x >= y);
             break;
 
         case wLT:
-            q.n = -(x.n < y.n);
+            *res = -(x < y);
             break;
 
         case wLE:
-            q.n = -(x.n <= y.n);
+            *res = -(x <= y);
             break;
 
         case wEQ:
-            q.n = -(x.n == y.n);
+            *res = -(x == y);
             break;
 
         case wNE:
-            q.n = -(x.n != y.n);
+            *res = -(x != y);
             break;
 
         case wAND:
@@ -332,72 +362,123 @@ computed evalloc(lego *l)
         case wIMP:
         case wNAND:
         case wNOR:
-            q = boolean_logic(x.n, y.n, l -> what);
-            break;
+            return boolean_logic(x, y, what, res);
 
         case wIDIV:
         case wMOD:
-            q = divmod(x.n, y.n, l -> what);
-            break;
+            return divmod(x, y, what, res);
 
         case wABS:
-            q.n = fabs(x.n);
-            break;
-
-        case wASC:
-            if (!*x.s) {
-                warn("need non-empty string");
-                goto exception;
-            }
-            q.n = *x.s;
+            *res = fabs(x);
             break;
 
         case wATAN:
-            q.n = atan(x.n);
+            *res = atan(x);
             break;
 
         case wCOS:
-            q.n = cos(x.n);
+            *res = cos(x);
             break;
 
         case wEXP:
-            q.n = exp(x.n);
+            *res = exp(x);
             break;
 
         case wFIX:
-            q.n = trunc(x.n);
+            *res = trunc(x);
             break;
 
         case wINT:
-            q.n = floor(x.n);
-            break;
-
-        case wLEN:
-            q.n = strlen(x.s);
+            *res = floor(x);
             break;
 
         case wLOG:
-            q.n = log(x.n);
+            *res = log(x);
             break;
 
         case wRND:
-            q.n = csprng(x.n);
+            *res = csprng(x);
             break;
 
         case wSGN:
-            q.n = (x.n > 0) - (x.n < 0);
+            *res = (x > 0) - (x < 0);
             break;
 
         case wSIN:
-            q.n = sin(x.n);
+            *res = sin(x);
             break;
 
         case wSQRT:
-            q.n = sqrt(x.n);
+            *res = sqrt(x);
             break;
 
         case wTAN:
-            q.n = tan(x.n);
+            *res = tan(x);
+            break;
+
+        default:
+            warn("unimplemented in evalloc");
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ *  Find where string 'b' first appears in string 'a' at or after index
+ *  'from', returning that index, or -1 if it doesn't.
+ */
+static int find(char *a, int from, char *b)
+{
+    int n = str_len(b), last = str_len(a) - n;
+    char *p;
+
+    if (!n)
+        return from <= last ? from : -1;
+    for (; from <= last; from = p - a + 1) {
+        if (!(p = memchr(a + from, *b, last - from + 1)))
+            break;
+        if (!memcmp(p, b, n))
+            return p - a;
+    }
+    return -1;
+}
+
+/*
+ *  Apply an operator or built-in function to already-computed arguments.
+ *  The arguments still belong to the caller, who must free them. This is
+ *  shared by evalloc() and the VM in run.c so they can't disagree.
+ */
+computed builtin(int what, computed x, computed y, computed z)
+{
+    int i, j, len;
+    char buf[num_room];
+    computed q = { 0 };
+
+    q.what = string_valued(what) ? rString : rNum;
+
+    switch (what) {
+
+        case wASC:
+            if (!str_len(x.s)) {
+                warn("need non-empty string");
+                goto exception;
+            }
+            q.n = (unsigned char) *x.s;
+            break;
+
+        case wLEN:
+            q.n = str_len(x.s);
+            break;
+
+        case wFRE:
+            q.n = str_free();
+            break;
+
+        case wFREMEM:
+            if (x.n < 0)
+                q.n = Mallocs;          /* FRE(-1): allocations so far */
+            else
+                q.n = mem_now[mSpare] + str_free();
             break;
 
         case wINSTR:
@@ -405,33 +486,26 @@ computed evalloc(lego *l)
                 warn("need positive integer");
                 goto exception;
             }
-            if (x.n > strlen(y.s))
-                q.n = 0;
-            else
-                s = strstr(y.s + (int) x.n - 1, z.s), q.n = s ? s - y.s + 1 : 0;
+            q.n = x.n > str_len(y.s) ? 0 : find(y.s, x.n - 1, z.s) + 1;
             break;
 
         case wCHR:
-            if (x.n != trunc(x.n) || x.n < 1 || x.n > 255) {
-                warn("need integer within 1 to 255");
+            if (x.n != trunc(x.n) || x.n < 0 || x.n > 255) {
+                warn("need integer within 0 to 255");
                 goto exception;
             }
-            s = getmem(2);
-            s[0] = x.n, s[1] = '\0';
-            q.s = s;
+            q.s = char_str(x.n);
             break;
 
         case wSTR:
-            s = getmem(max_str);
-            snprintf(s, max_str, trunc(x.n) == x.n ? "%.0f" : "%f", x.n);
-            q.s = s;
+            i = strlen(num_text(x.n, buf));
+            q.s = memcpy(make_str(i), buf, i);
             break;
 
         case wCAT:
-            s = getmem((i = strlen(x.s)) + strlen(y.s) + 1);
-            strcpy(s, x.s);
-            strcpy(s+i, y.s);
-            q.s = s;
+            q.s = make_str((i = str_len(x.s)) + str_len(y.s));
+            memcpy(q.s, x.s, i);
+            memcpy(q.s + i, y.s, str_len(y.s));
             break;
 
         /* TODO here thru MID$ works like TRS-80 but not like Python,
@@ -443,15 +517,14 @@ computed evalloc(lego *l)
                 goto exception;
             }
             i = ' ';
-            if (l -> what == wSTRING) {
-                if (!*y.s) {
+            if (what == wSTRING) {
+                if (!str_len(y.s)) {
                     warn("need non-empty string");
                     goto exception;
                 }
-                i = *y.s;
+                i = (unsigned char) *y.s;
             }
-            q.s = getmem(x.n + 1);
-            memset(q.s, i, x.n);
+            q.s = run_str(i, x.n);
             break;
 
         case wLEFT:
@@ -459,9 +532,9 @@ computed evalloc(lego *l)
                 warn("need non-negative integer");
                 goto exception;
             }
-            i = strlen(x.s);
+            i = str_len(x.s);
             i = i > y.n ? y.n : i;
-            q.s = copySubstring(x.s, x.s + i);
+            q.s = substr(x.s, 0, i);
             break;
 
         case wRIGHT:
@@ -469,9 +542,9 @@ computed evalloc(lego *l)
                 warn("need non-negative integer for RIGHT$");
                 goto exception;
             }
-            i = strlen(x.s);
-            i = i > y.n ? i - y.n : 0;
-            q.s = copySubstring(x.s + i, NULL);
+            len = str_len(x.s);
+            i = len > y.n ? len - y.n : 0;
+            q.s = substr(x.s, i, len);
             break;
 
         case wMID:
@@ -483,19 +556,73 @@ computed evalloc(lego *l)
                 warn("need non-negative integer");
                 goto exception;
             }
-            len = strlen(x.s);
+            len = str_len(x.s);
             i = y.n - 1, j = z.n;
             if (i > len)
                 i = len;
             if (i + j > len)
                 j = len - i;
-            q.s = copySubstring(x.s + i, x.s + i + j);
+            q.s = substr(x.s, i, i + j);
             break;
 
         default:
-            warn("unimplemented in evalloc");
-            goto exception;
+            if (!arith(what, x.n, y.n, &q.n))
+                goto exception;
+    }
+    return q;
+
+exception:
+    q.what = rExcept;
+    return q;
+}
+
+/*
+ *  Evaluate an operator or function lego by evaluating its arguments
+ *  and handing them to builtin().
+ */
+static computed apply(lego *l)
+{
+    int nargs = 0, i;
+    int except = 0;
+    computed q = { 0 }, x = { 0 }, y = { 0 }, z = { 0 };
+
+    /* figure out how many args */
+    if (l -> what < END_UNARY_GUYS)
+        nargs = 1;
+    else if (l -> what < END_BINARY_GUYS)
+        nargs = 2;
+    else if (l -> what < END_FUNCTION_GUYS) {
+        for (i=0; i<l -> args; i++)
+            if (l -> a[i])
+                ++nargs;
+    }
+    else {
+        warn("unimplemented evalloc");
+        goto exception;
+    }
+
+    /* get parameters as local variables (may have to free) */
+    switch (nargs) {
+        case 3:
+            z = evalloc(l -> a[2]);
+            if (z.what == rExcept)
+                except = 1;
+        case 2:
+            y = evalloc(l -> a[1]);
+            if (y.what == rExcept)
+                except = 1;
+        case 1:
+            x = evalloc(l -> a[0]);
+            if (x.what == rExcept)
+                except = 1;
     }
+
+    /* roll exceptions up the call stack */
+    if (except)
+        goto exception;
+
+    /* do what we have to do */
+    q = builtin(l -> what, x, y, z);
     goto done;
 
 
@@ -507,15 +634,101 @@ done:
     /* free intermediate results */
     switch (nargs) {
         case 3:
-            if (z.s)
-                zap(z.s);
+            zap_str(z.s);
         case 2:
-            if (y.s)
-                zap(y.s);
-        case 1:;
-            if (x.s)
-                zap(x.s);
+            zap_str(y.s);
+        case 1:
+            zap_str(x.s);
     }
 
     return q;
 }
+
+/*
+ *  Evaluate a numeric expression into 'n'. This never builds a
+ *  'computed' or touches a string, except for the few functions like
+ *  LEN that take strings. Returns 0 (with a warning) on error.
+ */
+int evalnum(lego *l, double *n)
+{
+    double x = 0, y = 0;
+    computed q;
+    varDB *v;
+
+    /* constant subexpressions were evaluated ahead of time */
+    if (l -> what < END_FUNCTION_GUYS && l -> link)
+        l = l -> link;
+
+    switch (l -> what) {
+        case wNUMLIT:
+            *n = l -> n;
+            return 1;
+        case wNUMVAR:
+            v = l -> link;
+            if (!v || v -> era != vars_era) {
+                warn("no such variable");
+                return 0;
+            }
+            *n = v -> n;
+            return 1;
+        case wASC:
+        case wFRE:
+        case wFREMEM:
+        case wINSTR:
+        case wLEN:
+        case wVAL:
+            q = apply(l);
+            *n = q.n;
+            return q.what != rExcept;
+    }
+
+    if (l -> what >= END_FUNCTION_GUYS || string_valued(l -> what)) {
+        warn("unimplemented evalnum");
+        return 0;
+    }
+    if (l -> a[0] && !evalnum(l -> a[0], &x))
+        return 0;
+    if (l -> args > 1 && l -> a[1] && !evalnum(l -> a[1], &y))
+        return 0;
+    return arith(l -> what, x, y, n);
+}
+
+/*
+ *  Evaluate a string or numeric expression, returning a string (which
+ *  the caller must drop) or a number.
+ */
+computed evalloc(lego *l)
+{
+    computed q = { 0 };
+    varDB *v;
+
+    /* constant subexpressions were evaluated ahead of time */
+    if (l -> what < END_FUNCTION_GUYS && l -> link)
+        l = l -> link;
+
+    /* numbers have their own quicker path */
+    if (!string_valued(l -> what)) {
+        q.what = evalnum(l, &q.n) ? rNum : rExcept;
+        return q;
+    }
+
+    /* direct return of strings */
+    switch (l -> what) {
+        case wSTRLIT:
+            q.what = rString;
+            q.s = share_str(l -> s);
+            return q;
+        case wSTRVAR:
+            v = l -> link;
+            if (!v || v -> era != vars_era) {
+                warn("no such variable");
+                q.what = rExcept;
+                return q;
+            }
+            q.what = rString;
+            q.s = share_str(v -> s);
+            return q;
+    }
+
+    return apply(l);
+}
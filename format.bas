@@ -0,0 +1,14 @@
+10 ' how numbers print: the fewest digits that read back the same
+20 ' each DATA pair is a number and the text STR$ should give for it
+30 F = 0
+40 FOR I = 1 TO 14
+50 READ X, E$
+60 S$ = STR$(X): IF LEN(S$) <> LEN(E$) OR INSTR(1, S$, E$) <> 1 THEN PRINT [wanted ]; E$; [ got ]; S$: F = F + 1
+70 NEXT
+80 IF F THEN PRINT [FAIL] ELSE PRINT [PASS]
+90 DATA 42, [42], -7, [-7], 2.5, [2.5], 1 / 4, [0.25], 0 - 0.00000025, [-0.00000025]
+100 DATA 1 / 3, [0.3333333333333333], 1 / 7, [0.14285714285714285]
+110 DATA 0.1 + 0.2, [0.30000000000000004], SQRT(2), [1.4142135623730951]
+120 DATA 1 / 3000000, [3.3333333333333335e-07], 2 ^ 60, [1152921504606846976]
+130 DATA 2 ^ 70, [1.1805916207174113e+21], 2 ^ -1074, [5e-324]
+140 DATA 2 ^ 1023 * 1.9999, [1.7976032502055728e+308]
@@ -0,0 +1,495 @@
+/*
+    Dayton Dynamic BASIC
+    program images
+    MWA 2018
+*/
+
+#include "all.h"
+
+/*
+ *  SAVE writes the program as an image: its legos laid out in an array,
+ *  with pointers turned into array indices, followed by a pool holding
+ *  all of the strings. LOAD maps an image and rebuilds the legos from
+ *  that array directly, so large programs needn't be parsed again.
+ *
+ *  Legos are stored with their 'what' values as is, so an image is only
+ *  good for the build of DDB that wrote it. The header says which, and
+ *  a checksum catches images that are damaged or cut short.
+ */
+enum { image_version = 1 };
+
+static char magic[8] = "DDBIMG\r\n";
+
+typedef struct image_header {
+    char magic[8];
+    int version;            /* image_version */
+    int guys;               /* END_VM_GUYS, so 'what' values agree */
+    int lego_size;          /* sizeof(image_lego) */
+    unsigned checksum;      /* of everything after the header */
+    int legos;              /* records, the first 'lines' being lines */
+    int lines;              /* numbered lines */
+    int pool;               /* bytes of strings after the records */
+    int unused;             /* keeps records that follow aligned */
+} image_header;
+
+typedef struct image_lego {
+    int what;
+    double n;
+    int s;                  /* offset in the pool, or -1 */
+    int link;               /* index of lego linked to, or -1 */
+    int a[max_args];        /* indices of arguments, or -1 */
+    int next;               /* index of next in list, or -1 */
+    char force_parens, lit_delim, list_delim, abbrev;
+} image_lego;
+
+static image_lego *recs;    /* records being written */
+static int rec_count;       /* records in 'recs' */
+static int rec_bytes;       /* bytes allocated for 'recs' */
+static char *pool;          /* strings being written */
+static int pool_used;       /* bytes in 'pool' */
+static int pool_bytes;      /* bytes allocated for 'pool' */
+static lego **saving;       /* the lines being written */
+static int saving_count;
+
+/*
+ *  FNV-1a hash of an image's contents, continuing from hash 'h'.
+ */
+static unsigned checksum(unsigned h, char *p, long n)
+{
+    while (n--)
+        h = (h ^ (unsigned char) *p++) * 16777619u;
+    return h;
+}
+
+/*
+ *  Return a buffer of 'used' bytes, grown if need be to fit 'more'.
+ */
+static void *room(void *buf, int *bytes, int used, int more)
+{
+    if (used + more <= *bytes)
+        return buf;
+    while (used + more > *bytes)
+        *bytes = *bytes ? 2 * *bytes : 4096;
+    if (!buf)
+        return getmem(*bytes);
+    if (!(buf = realloc(buf, *bytes))) {
+        outf("out of memory\n");
+        exit(1);
+    }
+    return buf;
+}
+
+/*
+ *  Find the index of a line being saved, which is its record's index.
+ */
+static int line_rec(lego *line)
+{
+    int lo = 0, hi = saving_count - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (saving[mid] == line)
+            return mid;
+        if (saving[mid] -> n < line -> n)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+static int put(lego *l);
+
+/*
+ *  Fill in record 'r' from lego 'l', adding records for those under it.
+ *  Lines are kept together at the start, so a line doesn't follow its
+ *  'next'. Records may move while those under 'l' are added.
+ */
+static void put_at(int r, lego *l)
+{
+    int i, len, link = -1, a[max_args], next = -1;
+
+    for (i=0; i<max_args; i++)
+        a[i] = i < l -> args ? put(l -> a[i]) : -1;
+    if (l -> what < END_FUNCTION_GUYS)
+        link = put(l -> link);      /* folded value */
+    else if (l -> what == wLINENUM && l -> link)
+        link = line_rec(l -> link);
+    if (l -> what != wNUMBEREDLINE)
+        next = put(l -> next);
+
+    recs[r].what = l -> what;
+    recs[r].n = l -> n;
+    recs[r].s = -1;
+    recs[r].link = link;
+    for (i=0; i<max_args; i++)
+        recs[r].a[i] = a[i];
+    recs[r].next = next;
+    recs[r].force_parens = l -> force_parens;
+    recs[r].lit_delim = l -> lit_delim;
+    recs[r].list_delim = l -> list_delim;
+    recs[r].abbrev = l -> abbrev;
+
+    if (l -> s && l -> what != wNUMBEREDLINE) {    /* not tokens.c's */
+        len = strlen(l -> s) + 1;
+        pool = room(pool, &pool_bytes, pool_used, len);
+        memcpy(pool + pool_used, l -> s, len);
+        recs[r].s = pool_used;
+        pool_used += len;
+    }
+}
+
+/*
+ *  Add a record for a lego (and those under it), returning its index.
+ */
+static int put(lego *l)
+{
+    int r;
+
+    if (!l)
+        return -1;
+    recs = room(recs, &rec_bytes, rec_count * sizeof(image_lego),
+        sizeof(image_lego));
+    put_at(r = rec_count++, l);
+    return r;
+}
+
+/*
+ *  Write an image of the program, whose 'count' lines are in 'lines'
+ *  in order. Returns true iff it was written.
+ */
+int save_image(char *name, lego **lines, int count)
+{
+    image_header h = { { 0 } };
+    FILE *f;
+    int i, ok;
+
+    /* Lay out the lines first, then everything under them. */
+    saving = lines, saving_count = count;
+    rec_count = count;
+    recs = room(recs, &rec_bytes, 0, count * sizeof(image_lego));
+    for (i=0; i<count; i++) {
+        put_at(i, lines[i]);
+        recs[i].next = i + 1 < count ? i + 1 : -1;
+    }
+
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = image_version;
+    h.guys = END_VM_GUYS;
+    h.lego_size = sizeof(image_lego);
+    h.legos = rec_count;
+    h.lines = count;
+    h.pool = pool_used;
+    h.checksum = checksum(checksum(2166136261u, (char *) recs,
+        rec_count * sizeof(image_lego)), pool, pool_used);
+
+    ok = 0;
+    if (!(f = fopen(name, "wb")))
+        warn("can't write file");
+    else {
+        ok = fwrite(&h, sizeof(h), 1, f) == 1
+            && (!rec_count
+                || fwrite(recs, sizeof(image_lego), rec_count, f) == rec_count)
+            && (!pool_used || fwrite(pool, 1, pool_used, f) == pool_used);
+        if (fclose(f) || !ok) {
+            ok = 0;
+            warn("can't write file");
+        }
+    }
+
+    zap(recs);
+    zap(pool);
+    rec_count = rec_bytes = pool_used = pool_bytes = 0;
+    saving = NULL, saving_count = 0;
+    return ok;
+}
+
+/*
+ *  Tell whether a file's contents are an image rather than text.
+ */
+int is_image(char *map, long size)
+{
+    return size >= sizeof(image_header) && !memcmp(map, magic, sizeof(magic));
+}
+
+/*
+ *  Tell whether a record's index 'k' is -1 or that of a later record,
+ *  as save_image() always writes them, so the legos can't form a loop.
+ */
+static int later(int k, int r, int count)
+{
+    return k == -1 || k > r && k < count;
+}
+
+/*
+ *  What a lego of kind 'what' has under it: a letter for each of a[0],
+ *  a[1], ... that it uses, and the rest must be empty. The letters are
+ *
+ *      n   numeric expression      s   string expression
+ *      e   either expression       t   statement
+ *      v   numeric variable        w   string variable
+ *      a   either variable         g   line reference (wLINENUM)
+ *      r   range of two line references
+ *
+ *  A capital means a list of them, and a letter after '?' may be
+ *  missing. Returns NULL for kinds that no parsed lego has.
+ */
+static char *shape(int what)
+{
+    switch (what) {
+        case wNEGATE: case wNOT: case wCHR: case wSPACE: case wSTR:
+        case wFREMEM:
+            return "n";
+        case wCAT:
+            return "ss";
+        case wLEFT: case wRIGHT:
+            return "sn";
+        case wMID:
+            return "snn";
+        case wSTRING:
+            return "ns";
+        case wASC: case wFRE: case wLEN: case wVAL:
+            return "s";
+        case wINSTR:
+            return "nss";
+        case wNEW: case wEND: case wSTOP: case wCONT: case wRETURN:
+        case wCLS: case wMEM: case wREM: case wSTRLIT: case wSTRVAR:
+        case wNUMLIT: case wNUMVAR: case wLINENUM:
+            return "";
+        case wLIST: case wDEL: case wDISASM:
+            return "r";
+        case wGOSUB: case wGOTO:
+            return "g";
+        case wRUN: case wRESTORE:
+            return "?g";
+        case wONGOTO: case wONGOSUB:
+            return "nG";
+        case wFOR:
+            return "vnn?n";
+        case wNEXT:
+            return "?v";
+        case wREAD:
+            return "A";
+        case wDATA:
+            return "E";
+        case wPRINT:
+            return "?E";
+        case wINPUT:
+            return "?sA";
+        case wIF:
+            return "nT?T";
+        case wLET:
+            return "ae";
+        case wLINEINPUT:
+            return "w";
+        case wALTER:
+            return "gg";
+        case wONALTER:
+            return "ngG";
+        case wLOAD: case wSAVE:
+            return "s";
+        case wCLEAR:
+            return "?n";
+        case wNUMBEREDLINE:
+            return "?T";
+    }
+    if (what > END_UNARY_GUYS && what < END_BINARY_GUYS)
+        return "nn";
+    if (what > END_BINARY_GUYS && what < END_FUNCTION_GUYS)
+        return "n";
+    return NULL;
+}
+
+/*
+ *  How many legos a lego of kind 'what' can have under it, and so how
+ *  much room newLego() makes for them.
+ */
+int lego_args(int what)
+{
+    static unsigned char args[wJUMP];
+    static int known;
+    char *p;
+    int i;
+
+    if (!known) {
+        for (i=0; i<wJUMP; i++) {
+            if (!(p = shape(i)))
+                args[i] = max_args;
+            else
+                for (; *p; p++)
+                    args[i] += *p != '?';
+        }
+        known = 1;
+    }
+    return what < wJUMP ? args[what] : max_args;
+}
+
+/*
+ *  Tell whether a lego of kind 'what' can be an expression.
+ */
+static int expression(int what)
+{
+    return what < END_FUNCTION_GUYS && shape(what) || what == wSTRLIT
+        || what == wSTRVAR || what == wNUMLIT || what == wNUMVAR;
+}
+
+/*
+ *  Tell whether a lego of kind 'what' fits shape letter 'c'.
+ */
+static int fits(int what, int c)
+{
+    switch (tolower(c)) {
+        case 'n': return expression(what) && !string_valued(what);
+        case 's': return expression(what) && string_valued(what);
+        case 'e': return expression(what);
+        case 't': return what > END_FUNCTION_GUYS && what < END_STATEMENT_GUYS;
+        case 'v': return what == wNUMVAR;
+        case 'w': return what == wSTRVAR;
+        case 'a': return what == wNUMVAR || what == wSTRVAR;
+        case 'g': case 'r': return what == wLINENUM;
+    }
+    return 0;
+}
+
+/*
+ *  Tell whether record 'k' (and any that follow it in a list) fits
+ *  shape letter 'c'. Indices are known to be good by now.
+ */
+static int fits_at(image_lego *r, int k, int c)
+{
+    if (!fits(r[k].what, c))
+        return 0;
+    if (c == 'r')
+        return (k = r[k].next) >= 0 && fits(r[k].what, 'g') && r[k].next < 0;
+    if (islower(c))
+        return r[k].next < 0;
+    while ((k = r[k].next) >= 0)
+        if (!fits(r[k].what, c))
+            return 0;
+    return 1;
+}
+
+/*
+ *  Tell whether record 'i' has what its kind needs under it.
+ */
+static int well_formed(image_lego *r, int i)
+{
+    char *p = shape(r[i].what);
+    int j, k, optional, what = r[i].what;
+
+    if (!p)
+        return 0;
+    for (j=0; j<max_args; j++) {
+        k = r[i].a[j];
+        if (optional = *p == '?')
+            ++p;
+        if (!*p ? k >= 0 : k < 0 ? !optional : !fits_at(r, k, *p))
+            return 0;
+        if (*p)
+            ++p;
+    }
+    if ((what == wSTRLIT || what == wSTRVAR || what == wNUMVAR)
+            && r[i].s < 0)
+        return 0;
+    if (what == wLET
+            && string_valued(r[r[i].a[0]].what)
+                != string_valued(r[r[i].a[1]].what))
+        return 0;
+
+    /* a folded value is a literal of the same type */
+    k = r[i].link;
+    return what >= END_FUNCTION_GUYS || k < 0
+        || (r[k].what == wNUMLIT || r[k].what == wSTRLIT)
+            && string_valued(r[k].what) == string_valued(what);
+}
+
+/*
+ *  Check an image's records for sense: every 'what' is one a parsed
+ *  lego could have, the lines come first in ascending order, every
+ *  index is in range, and each lego has what its kind needs under it.
+ *  Returns true iff they can be trusted.
+ */
+static int sane(image_lego *r, int legos, int lines, int pool)
+{
+    int i, j;
+
+    for (i=0; i<legos; i++) {
+        if (r[i].what <= wZERO_IS_UNUSED || r[i].what >= wJUMP
+                || (i < lines) != (r[i].what == wNUMBEREDLINE)
+                || i && i < lines && r[i].n <= r[i - 1].n
+                || r[i].s < -1 || r[i].s >= pool)
+            return 0;
+        for (j=0; j<max_args; j++)
+            if (!later(r[i].a[j], i, legos))
+                return 0;
+        if (!later(r[i].next, i, legos))
+            return 0;
+        if (r[i].what == wLINENUM ? r[i].link < -1 || r[i].link >= lines
+                : !later(r[i].link, i, legos))
+            return 0;
+    }
+    for (i=0; i<legos; i++)
+        if (!well_formed(r, i))
+            return 0;
+    return 1;
+}
+
+/*
+ *  Rebuild a program from an image mapped into memory, returning its
+ *  lines in '*result' as a list in order. Returns 0 (with a warning)
+ *  if the image is stale or damaged.
+ */
+int load_image(char *map, long size, lego **result)
+{
+    image_header *h = (image_header *) map;
+    image_lego *r = (image_lego *) (h + 1);
+    char *strings;
+    lego **made;
+    int i, j, k;
+
+    *result = NULL;
+    if (h -> version != image_version || h -> guys != END_VM_GUYS
+            || h -> lego_size != sizeof(image_lego)) {
+        warn("image is from another version of DDB");
+        return 0;
+    }
+    if (h -> legos < h -> lines || h -> lines < 0 || h -> pool < 0
+            || size != sizeof(image_header)
+                + (long) h -> legos * sizeof(image_lego) + h -> pool) {
+        warn("image is damaged");
+        return 0;
+    }
+    strings = (char *) (r + h -> legos);
+    if (h -> checksum != checksum(2166136261u, (char *) r,
+                size - sizeof(image_header))
+            || h -> pool && strings[h -> pool - 1]
+            || !sane(r, h -> legos, h -> lines, h -> pool)) {
+        warn("image is damaged");
+        return 0;
+    }
+
+    /* Make every lego, then fix up pointers between them. */
+    made = getmem((h -> legos + 1) * sizeof(lego *));
+    ++made;                         /* so made[-1] is NULL */
+    for (i=0; i<h -> legos; i++) {
+        made[i] = newLego(r[i].what);
+        made[i] -> n = r[i].n;
+        made[i] -> force_parens = r[i].force_parens;
+        made[i] -> lit_delim = r[i].lit_delim;
+        made[i] -> list_delim = r[i].list_delim;
+        made[i] -> abbrev = r[i].abbrev;
+    }
+    for (i=0; i<h -> legos; i++) {
+        for (j=0; j<made[i] -> args; j++)
+            made[i] -> a[j] = made[r[i].a[j]];
+        made[i] -> next = made[r[i].next];
+        made[i] -> link = made[r[i].link];
+        if ((k = r[i].s) >= 0)
+            made[i] -> s = copySubstring(strings + k, NULL);
+    }
+
+    *result = h -> lines ? made[0] : NULL;
+    --made;
+    zap(made);
+    return 1;
+}
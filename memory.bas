@@ -0,0 +1,7 @@
+10 ' where memory goes, by FRE and MEM, even out of DATA
+20 CLEAR 1000
+30 A$ = [x]: FOR I = 1 TO 5: A$ = A$ + A$: NEXT
+40 READ S, C: DATA FRE([]), FRE(0)
+50 PRINT [string space free: ]; S; [ of 1000]
+60 PRINT [spare bytes: ]; C
+70 MEM
@@ -46,7 +46,8 @@ int nothingMore(char **ss)
  *  An artificial restriction is imposed for clarity: you're not allowed
  *  to choose spaces or non-printing characters as delimiters.
  *
- *  Strings in this system can't hold CHR$(0), the ASCII null.
+ *  Literals can't hold CHR$(0), the ASCII null, though strings built
+ *  with CHR$ can.
  */
 int str_lit(char **ss, lego **result)
 {
@@ -148,8 +149,7 @@ int line_num(char **ss, lego **result)
         byeLego(res);
         return 0;
     }
-    res -> what = wLINENUM;
-    *result = res;
+    *result = reLego(res, wLINENUM);
     *ss = s;
     return 1;
 }
@@ -526,20 +526,35 @@ int str_exp(char **ss, lego **result)
  *      num_lit
  *      num_var
  *      ( num_exp )
+ *      FRE ( num_exp )
  *      func_returning_num ( argument_list )
  */
 int num_term(char **ss, lego **result)
 {
-    char *s = *ss;
-    lego *sub;
+    char *s = *ss, *was;
+    lego *sub, *l;
     int error;
-    char *fns[] = { "abs", "asc", "atan", "cos", "exp", "fix", "instr", "int",
-        "len", "log", "rnd", "sgn", "sin", "sqrt", "tan", "val", NULL };
-    char *args[] = { "n", "s", "n", "n", "n", "n", "nss", "n",
+    char *fns[] = { "abs", "asc", "atan", "cos", "exp", "fix", "fre", "instr",
+        "int", "len", "log", "rnd", "sgn", "sin", "sqrt", "tan", "val", NULL };
+    char *args[] = { "n", "s", "n", "n", "n", "n", "s", "nss", "n",
         "s", "n", "n", "n", "n", "n", "n", "s", NULL };
-    int enums[] = { wABS, wASC, wATAN, wCOS, wEXP, wFIX, wINSTR,
+    int enums[] = { wABS, wASC, wATAN, wCOS, wEXP, wFIX, wFRE, wINSTR,
         wINT, wLEN, wLOG, wRND, wSGN, wSIN, wSQRT, wTAN, wVAL, 0 };
 
+    /* FRE of a number, rather than a string, is about memory. */
+    was = warning;
+    if (keyword(&s, "fre") && symbol(&s, "(") && num_exp(&s, &sub)) {
+        if (symbol(&s, ")")) {
+            l = newLego(wFREMEM);
+            l -> a[0] = sub;
+            sub = l;
+            goto Y;
+        }
+        byeLego(sub);
+    }
+    s = *ss;
+    warning = was;
+
     if (general_function_factory(&s, &sub, fns, args, enums, &error))
         goto Y;
     if (error)
@@ -920,10 +935,11 @@ int print_list(char **ss, lego **result)
  *      CONT
  *      RETURN
  *      CLS
+ *      MEM
  */
 int trivial_st(char **ss, lego **result)
 {
-    int enums[] = { wNEW, wEND, wSTOP, wCONT, wRETURN, wCLS, 0 };
+    int enums[] = { wNEW, wEND, wSTOP, wCONT, wRETURN, wCLS, wMEM, 0 };
 
     return general_keyword_factory(ss, result, enums);
 }
@@ -932,12 +948,13 @@ int trivial_st(char **ss, lego **result)
  *  line_range_st:
  *      LIST [line_range]
  *      DEL [line_range]
+ *      DISASM [line_range]
  *
  *  If the range is omitted, a default range list is added for convenience.
  */
 int line_range_st(char **ss, lego **result)
 {
-    int enums[] = { wLIST, wDEL, 0 };
+    int enums[] = { wLIST, wDEL, wDISASM, 0 };
     lego *range;
 
     if (!general_keyword_factory(ss, result, enums))
@@ -1321,6 +1338,49 @@ int line_in_st(char **ss, lego **result)
     return 1;
 }
 
+/*
+ *  load_save_st:
+ *      LOAD str_exp
+ *      SAVE str_exp
+ */
+int load_save_st(char **ss, lego **result)
+{
+    char *s = *ss;
+    int enums[] = { wLOAD, wSAVE, 0 };
+    lego *l, *name;
+
+    if (!general_keyword_factory(&s, &l, enums))
+        return 0;
+    if (!str_exp(&s, &name)) {
+        warn("need file name after LOAD or SAVE");
+        byeLego(l);
+        return 0;
+    }
+    l -> a[0] = name;
+    *result = l;
+    *ss = s;
+    return 1;
+}
+
+/*
+ *  clear_st:
+ *      CLEAR [num_exp]
+ */
+int clear_st(char **ss, lego **result)
+{
+    char *s = *ss;
+    lego *size = NULL;
+
+    if (!keyword(&s, "clear"))
+        return 0;
+    if (!num_exp(&s, &size))
+        size = NULL;
+    *result = newLego(wCLEAR);
+    (*result) -> a[0] = size;
+    *ss = s;
+    return 1;
+}
+
 /*
  *  alter_st:
  *      ALTER line_num TO [PROCEED TO] line_num
@@ -1434,6 +1494,8 @@ N:  byeLego(res);
  *      line_in_st
  *      alter_st
  *      on_alter_st
+ *      load_save_st
+ *      clear_st
  *      let_st
  */
 int statement(char **ss, lego **result)
@@ -1442,7 +1504,8 @@ int statement(char **ss, lego **result)
         trivial_st,    line_range_st,  line_num_st,  line_list_st, 
         rem_st,        for_st,         next_st,      if_st,
         read_data_st,  print_st,       input_st,     line_in_st,
-        alter_st,      on_alter_st,    let_st,       NULL
+        alter_st,      on_alter_st,    load_save_st, clear_st,
+        let_st,        NULL
     };
 
     for (f=fn; *f; f++)
@@ -1474,11 +1537,11 @@ int command(char **ss, lego **result)
     char *s = *ss;
     lego *ln = NULL, *sts = NULL;
 
-    line_num(&s, &ln);
+    if (line_num(&s, &ln))
+        ln = reLego(ln, wNUMBEREDLINE);     /* now, while it can grow */
     statements(&s, &sts);
 
     if (ln) {
-        ln -> what = wNUMBEREDLINE;
         ln -> a[0] = sts;
         *result = ln;
         *ss = s;
@@ -17,7 +17,7 @@ void printLego(lego *l)
     lego *loop;
 
     if (!l) {
-        printf("NULL!");
+        outf("NULL!");
         return;
     }
 
@@ -30,13 +30,13 @@ void printLego(lego *l)
     parens = l -> what < END_BINARY_GUYS
         && (l -> force_parens || forceParens);
     if (parens)
-        printf("(");
+        outf("(");
 
     /*
      *  Unary operations are recursively printed.
      */
     if (l -> what < END_UNARY_GUYS) {
-        printf("%s", guys[l -> what]);
+        outf("%s", guys[l -> what]);
         printLego(l -> a[0]);
     }
 
@@ -45,7 +45,7 @@ void printLego(lego *l)
      */
     else if (l -> what < END_BINARY_GUYS) {
         printLego(l -> a[0]);
-        printf(" %s ", guys[l -> what]);
+        outf(" %s ", guys[l -> what]);
         printLego(l -> a[1]);
     }
 
@@ -53,13 +53,13 @@ void printLego(lego *l)
      *  Functions and their arguments are recursively printed.
      */
     else if (l -> what < END_FUNCTION_GUYS) {
-        printf("%s(", guys[l -> what]);
-        for (i=0; i<max_args && l -> a[i]; i++) {
+        outf("%s(", guys[l -> what]);
+        for (i=0; i<l -> args && l -> a[i]; i++) {
             if (i)
-                printf(", ");
+                outf(", ");
             printLego(l -> a[i]);
         }
-        printf(")");
+        outf(")");
     }
 
     /*
@@ -70,32 +70,32 @@ void printLego(lego *l)
     else switch (l -> what) {
 
         case wSTRVAR:
-            printf("%s$", l -> s);
+            outf("%s$", l -> s);
             break;
 
         case wSTRLIT:
             if (l -> lit_delim)
-                printf("]%c%s%c", l -> lit_delim, l -> s, l -> lit_delim);
+                outf("]%c%s%c", l -> lit_delim, l -> s, l -> lit_delim);
             else
-                printf("[%s]", l -> s);
+                outf("[%s]", l -> s);
             break;
 
         case wNUMVAR:
-            printf("%s", l -> s);
+            outf("%s", l -> s);
             break;
 
         case wNUMLIT:
         case wLINENUM:
         case wNUMBEREDLINE:
-            printf(trunc(l -> n) == l -> n ? "%.0f" : "%f", l -> n);
+            out_num(l -> n);
             if (l -> what == wNUMBEREDLINE && l -> a[0]) {
-                printf(" ");
+                outf(" ");
                 printLego(l -> a[0]);
             }
             break;
 
         case wREM:
-            printf("%s %s", l -> abbrev ? "'" : "REM", l -> s);
+            outf("%s %s", l -> abbrev ? "'" : "REM", l -> s);
             break;
 
         case wNEW:
@@ -104,158 +104,174 @@ void printLego(lego *l)
         case wCONT:
         case wRETURN:
         case wCLS:
-            printf("%s", guys[l -> what]);
+        case wMEM:
+            outf("%s", guys[l -> what]);
             break;
 
         case wLIST:
         case wDEL:
-            printf("%s", guys[l -> what]);
+        case wDISASM:
+            outf("%s", guys[l -> what]);
             a = l -> a[0] -> n;
             b = l -> a[0] -> next -> n;
             if (a < 0 && b < 0)
                 ;
             else if (a == b)
-                printf(" %.0f", a);
+                outf(" %.0f", a);
             else if (a < 0)
-                printf(" -%.0f", b);
+                outf(" -%.0f", b);
             else if (b < 0)
-                printf(" %.0f-", a);
+                outf(" %.0f-", a);
             else
-                printf(" %.0f-%.0f", a, b);
+                outf(" %.0f-%.0f", a, b);
+            break;
+
+        case wLOAD:
+        case wSAVE:
+            outf("%s ", guys[l -> what]);
+            printLego(l -> a[0]);
+            break;
+
+        case wCLEAR:
+            outf("CLEAR");
+            if (l -> a[0]) {
+                outf(" ");
+                printLego(l -> a[0]);
+            }
             break;
 
         case wGOSUB:
         case wGOTO:
         case wRUN:
         case wRESTORE:
-            printf("%s", guys[l -> what]);
+            outf("%s", guys[l -> what]);
             if (l -> a[0])
-                printf(" %.0f", l -> a[0] -> n);
+                outf(" %.0f", l -> a[0] -> n);
             break;
 
         case wONGOTO:
         case wONGOSUB:
-            printf("ON ");
+            outf("ON ");
             printLego(l -> a[0]);
-            printf(l -> what == wONGOTO ? " GOTO " : " GOSUB ");
+            outf(l -> what == wONGOTO ? " GOTO " : " GOSUB ");
             for (loop = l -> a[1]; loop; loop = loop -> next) {
                 printLego(loop);
                 if (loop -> next)
-                    printf(", ");
+                    outf(", ");
             }
             break;
 
         case wFOR:
-            printf("FOR ");
+            outf("FOR ");
             printLego(l -> a[0]);
-            printf(" = ");
+            outf(" = ");
             printLego(l -> a[1]);
-            printf(" TO ");
+            outf(" TO ");
             printLego(l -> a[2]);
             if (l -> a[3]) {
-                printf(" STEP ");
+                outf(" STEP ");
                 printLego(l -> a[3]);
             }
             break;
 
         case wNEXT:
-            printf("NEXT");
+            outf("NEXT");
             if (l -> a[0]) {
-                printf(" ");
+                outf(" ");
                 printLego(l -> a[0]);
             }
             break;
 
         case wIF:
-            printf("IF ");
+            outf("IF ");
             printLego(l -> a[0]);
-            printf(" THEN ");
+            outf(" THEN ");
             printLego(l -> a[1]);
             if (l -> a[2]) {
-                printf(" ELSE ");
+                outf(" ELSE ");
                 printLego(l -> a[2]);
             }
             break;
 
         case wREAD:
         case wDATA:
-            printf("%s ", guys[l -> what]);
+            outf("%s ", guys[l -> what]);
             for (loop = l -> a[0]; loop; loop = loop -> next) {
                 printLego(loop);
                 if (loop -> next)
-                    printf(", ");
+                    outf(", ");
             }
             break;
 
         case wLET:
             if (!l -> abbrev)
-                printf("LET ");
+                outf("LET ");
             printLego(l -> a[0]);
-            printf(" = ");
+            outf(" = ");
             printLego(l -> a[1]);
             break;
 
         case wLINEINPUT:
-            printf("LINE INPUT ");
+            outf("LINE INPUT ");
             printLego(l -> a[0]);
             break;
 
         case wPRINT:
-            printf("%s", l -> abbrev ? "?" : "PRINT");
+            outf("%s", l -> abbrev ? "?" : "PRINT");
             for (loop = l -> a[0]; loop; loop = loop -> next) {
-                printf(" ");
+                outf(" ");
                 printLego(loop);
                 if (loop -> list_delim)
-                    printf(";");
+                    outf(";");
                 else if (loop -> next)
-                    printf(",");
+                    outf(",");
             }
             break;
 
         case wINPUT:
-            printf("INPUT ");
+            outf("INPUT ");
             if (l -> a[0]) {
                 printLego(l -> a[0]);
-                printf("; ");
+                outf("; ");
             }
             for (loop = l -> a[1]; loop; loop = loop -> next) {
                 printLego(loop);
                 if (loop -> next)
-                    printf(", ");
+                    outf(", ");
             }
             break;
 
         case wALTER:
-            printf("ALTER ");
+            outf("ALTER ");
             printLego(l -> a[0]);
-            printf(" TO ");
+            outf(" TO ");
             if (!l -> abbrev)
-                printf("PROCEED TO ");
+                outf("PROCEED TO ");
             printLego(l -> a[1]);
             break;
 
         case wONALTER:
-            printf("ON ");
+            outf("ON ");
             printLego(l -> a[0]);
-            printf(" ALTER ");
+            outf(" ALTER ");
             printLego(l -> a[1]);
-            printf(" TO ");
+            outf(" TO ");
             if (!l -> abbrev)
-                printf("PROCEED TO ");
+                outf("PROCEED TO ");
             for (loop = l -> a[2]; loop; loop = loop -> next) {
                 printLego(loop);
                 if (loop -> next)
-                    printf(", ");
+                    outf(", ");
             }
             break;
 
         default:
-            printf("*UNIMPLEMENTED*");
+            outf("*UNIMPLEMENTED*");
 
     }
 
     if (parens)
-        printf(")");
+        outf(")");
 
     /*
      *  Colon-separated chains of statements on the same line are printed
@@ -263,7 +279,7 @@ void printLego(lego *l)
      */
     if (l -> what > END_FUNCTION_GUYS 
             && l -> what < END_STATEMENT_GUYS && l -> next) {
-        printf(": ");
+        outf(": ");
         printLego(l -> next);
     }
 }
@@ -0,0 +1,97 @@
+10 ' lines re-entered or deleted give their memory back: type this in,
+20 ' as ./ddb < replace.bas (or COMPACT=1 ./ddb < replace.bas)
+30 PRINT [a line that's re-entered]
+40 PRINT [and one that's deleted]
+M = FRE(0)
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+30 PRINT [a line that's re-entered]
+40
+40 PRINT [and one that's deleted]
+IF FRE(0) >= M THEN PRINT [PASS] ELSE PRINT [FAIL]
+MEM
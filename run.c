@@ -7,77 +7,210 @@
 #include "all.h"
 
 /*
- *  Stack that enables NEXT to work.
+ *  Stack frame that enables NEXT to work.
  */
-typedef struct next_stack {
-    char *nVar;         /* name of numeric variable */
-    double vi;          /* initial value */
-    double de;          /* ending value (if in right direction) */
+typedef struct next_frame {
+    varDB *var;         /* numeric variable */
+    double de;          /* ending value (NAN if the loop never ends) */
     double step;        /* increment */
-    lego *line;         /* line to return to at NEXT */
-    lego *stmt;         /* statement in line to return to at NEXT */
-    struct next_stack *next;
-} next_stack;
-
-/*
- *  Stack that enables RETURN to work.
- */
-typedef struct ret_stack {
-    lego *line;         /* NUMBERED line to return to, if any */
-    lego *stmt;         /* statement within line to return to, if any */
-    int running;        /* whether returning to program or immediate */
-    struct ret_stack *next;
-} ret_stack;
+    int up;             /* counting up, so 'de' is a maximum */
+    code *pc;           /* code to return to at NEXT */
+} next_frame;
 
 /*
  *  Execution context. We'll need one for the BASIC program
  *  (with line numbers), and one for immediate commands (no line numbers)
  *  that could happen between STOP and CONT.
+ *
+ *  GOSUB and FOR frames are kept in arrays that grow as needed, so
+ *  a GOSUB or FOR in a loop doesn't allocate anything after its first
+ *  time around.
  */
 typedef struct x_con {
-    lego *line;             /* current NUMBERED line within program, if any */
-    lego *stmt;             /* statement within line to execute */
+    code *pc;               /* next instruction to execute, if any */
     lego *data_line;        /* RESTORE points here */
     lego *data_stmt;        /* READ advances this */
     lego *data_datum;       /* READ also advances this */
-    ret_stack *ret_to;      /* where to go when we see a RETURN */
-    next_stack *next_to;    /* where to go when we see a NEXT */
+    code **ret_to;          /* where to go when we see a RETURN */
+    int rets, ret_room;     /* frames used and allocated in 'ret_to' */
+    next_frame *next_to;    /* where to go when we see a NEXT */
+    int nexts, next_room;   /* frames used and allocated in 'next_to' */
     double lNum;            /* number of current line, or < 0 for immediate */
+    int deep;               /* values 'pc's code can have on the stacks */
 } x_con;
 
+int max_depth = 10000;  /* most GOSUBs (or FORs) in progress; see MAXDEPTH */
+
 static lego *program;   /* sorted, linked list of line #s w/ attached code */
+static lego **lines;    /* the same lines in a sorted array, for searching */
+static int line_count;  /* lines in 'program' and 'lines' */
+static int line_room;   /* room allocated in 'lines' */
+
+/*
+ *  In compact mode (see COMPACT), a line in the program is only its
+ *  number and its tokens, kept in the 's' of its lego; see tokens.c.
+ *  Legos for every line are made again from their tokens when the
+ *  program is linked, and let go of once it's edited or ends.
+ */
+int compact;            /* keep lines as tokens */
+static arena *packed;   /* where lines kept as tokens are */
+static lego *unused;    /* those let go of, for reuse, through 'next' */
+static arena *trees;    /* legos made from their tokens, if any */
+
+/*
+ *  Linking is remembered between runs, so that it only has to be
+ *  redone for lines that were edited since, and for references to
+ *  them. 'refs' holds every line reference in the program, along with
+ *  the number of the line it's in.
+ */
+typedef struct line_ref {
+    lego *ref;              /* wLINENUM lego */
+    double from;            /* number of the line it's in */
+} line_ref;
+
+static line_ref *refs;      /* every line reference in the program */
+static int ref_count, ref_room;
+static double *edited;      /* numbers of lines edited since linking */
+static int edit_count, edit_room;
+static int program_gen;     /* bumped whenever the program is edited */
+static int linked_gen = -1; /* 'program_gen' when it was last linked */
+static int relink_all = 1;  /* forget 'refs', and link everything */
+static code *prog_code; /* 'program' compiled, or NULL if not yet */
 static int dirty;       /* "dirty" means not in column 1 of output */
 static x_con prog_con;  /* context of current program */
 static lego *start_at;  /* position to start at (e.g. "RUN 500") */
+static void **labels;   /* where execute() implements each opcode */
 
 /*
- *  Prevent program from continuing, but keep it and its vars.
+ *  Kill all GOSUB subroutines and FOR loops in progress.
  */
-void reset_program(void)
+void clear_stacks(x_con *c)
+{
+    mem_count(mStacks, -(long) (c -> ret_room * sizeof(code *)
+        + c -> next_room * sizeof(next_frame)));
+    zap(c -> ret_to);
+    zap(c -> next_to);
+    c -> rets = c -> ret_room = 0;
+    c -> nexts = c -> next_room = 0;
+}
+
+/*
+ *  Make room to push one more frame of 'size' bytes onto a stack that
+ *  has 'used' frames, growing it if need be. Returns 0 (with a warning)
+ *  if the stack would grow beyond max_depth.
+ */
+static int stack_room(void **stack, int *room, int used, int size)
 {
-    ret_stack *rs;
-    next_stack *ns;
+    int more;
 
-    /* Kill all GOSUB subroutines in progress. */
-    while (prog_con.ret_to) {
-        rs = prog_con.ret_to -> next;
-        zap(prog_con.ret_to);
-        prog_con.ret_to = rs;
+    if (used < *room)
+        return 1;
+    if (used >= max_depth) {
+        warn("stack overflow");
+        return 0;
     }
 
-    /* Kill all FOR loops in progress. */
-    while (prog_con.next_to) {
-        ns = prog_con.next_to -> next;
-        zap(prog_con.next_to -> nVar);
-        zap(prog_con.next_to);
-        prog_con.next_to = ns;
+    more = *room ? 2 * *room : 16;
+    if (more > max_depth)
+        more = max_depth;
+    if (!*stack)
+        *stack = getmem(more * size);
+    else if (!(*stack = realloc(*stack, more * size))) {
+        outf("out of memory\n");
+        exit(1);
     }
+    mem_count(mStacks, (long) (more - *room) * size);
+    *room = more;
+    return 1;
+}
+
+/*
+ *  Prevent program from continuing, but keep it and its vars.
+ */
+void reset_program(void)
+{
+    clear_stacks(&prog_con);
 
     /* Reinitialize the program context. */
     memset(&prog_con, 0, sizeof(prog_con));
     prog_con.data_line = program;
 }
 
+/*
+ *  Keep a line as tokens instead of legos, returning its new lego.
+ */
+static lego *pack_line(lego *l)
+{
+    arena *was = lego_arena;
+    lego *line;
+
+    if (!packed) {
+        packed = new_arena();
+        keep_arena(packed);
+    }
+    if (line = unused)
+        unused = line -> next, line -> next = NULL;
+    else {
+        lego_arena = packed;
+        line = newLego(wNUMBEREDLINE);
+        lego_arena = was;
+    }
+    line -> n = l -> n;
+    line -> s = tokenize(l -> a[0]);
+    return line;
+}
+
+/*
+ *  Let go of a line kept as tokens, once it's left the program. Its
+ *  tokens are freed, and its lego saved for the next line packed.
+ */
+static void drop_packed(lego *line)
+{
+    zap_str(line -> s);
+    line -> a[0] = NULL;
+    line -> next = unused;
+    unused = line;
+}
+
+/*
+ *  Make legos for a compact program's lines from their tokens, unless
+ *  that's been done already.
+ */
+static void unpack_program(void)
+{
+    arena *was = lego_arena;
+    int i;
+
+    if (!compact || trees)
+        return;
+    lego_arena = trees = new_arena();
+    keep_arena(trees);
+    for (i = 0; i < line_count; i++) {
+        lines[i] -> a[0] = untokenize(lines[i] -> s);
+        fold(lines[i] -> a[0]);
+    }
+    lego_arena = was;
+    linked_gen = -1, relink_all = 1;
+}
+
+/*
+ *  Let go of the legos made from a compact program's tokens. Compiled
+ *  code and linkage go along with them.
+ */
+static void drop_trees(void)
+{
+    int i;
+
+    if (!trees)
+        return;
+    zap(prog_code);
+    for (i = 0; i < line_count; i++)
+        lines[i] -> a[0] = NULL;
+    drop_arena(trees);
+    trees = NULL;
+    linked_gen = -1, relink_all = 1;
+}
+
 /*
  *  Remove program.
  */
@@ -86,18 +219,112 @@ void erase_program(void)
     lego *bye;
 
     reset_program();
+    drop_trees();
+    zap(prog_code);
 
     /* This loop removes a line at a time from the program. */
     while (program) {
         bye = program -> next;
-        program -> next = NULL;
-        byeLego(program);
+        drop_line(program);
         program = bye;
     }
+    zap(lines);
+    line_count = line_room = 0;
+    if (packed)
+        drop_arena(packed);
+    packed = NULL;
+    unused = NULL;
+    zap(refs);
+    zap(edited);
+    ref_count = ref_room = edit_count = edit_room = 0;
+    relink_all = 1;
+    ++program_gen;
 
     erase_run_vars();
 }
 
+/*
+ *  Find the index within 'lines' of the first line numbered 'lNum'
+ *  or more, or 'line_count' if there isn't one.
+ */
+static int line_index(double lNum)
+{
+    int lo = 0, hi = line_count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (lines[mid] -> n < lNum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ *  Append an item of 'size' bytes to a growable array, returning
+ *  where it goes.
+ */
+static void *append(void **array, int *count, int *room, int size)
+{
+    if (*count == *room) {
+        *room = *room ? 2 * *room : 64;
+        if (!*array)
+            *array = getmem(*room * size);
+        else if (!(*array = realloc(*array, *room * size))) {
+            outf("out of memory\n");
+            exit(1);
+        }
+    }
+    return (char *) *array + (*count)++ * size;
+}
+
+/*
+ *  Remember that a line was added, replaced or deleted.
+ */
+static void edited_line(double lNum)
+{
+    ++program_gen;
+    if (relink_all)
+        return;
+    if (edit_count > line_count)
+        relink_all = 1;     /* cheaper to start over */
+    else
+        *(double *) append((void **) &edited, &edit_count, &edit_room,
+            sizeof(double)) = lNum;
+}
+
+/*
+ *  After 'lines' changes at index 'i', make the linked list agree.
+ */
+static void mend_lines(int i)
+{
+    lego *here = i < line_count ? lines[i] : NULL;
+
+    if (i)
+        lines[i - 1] -> next = here;
+    else
+        program = here;
+}
+
+/*
+ *  Remove lines 'from' up to (not including) 'upto'.
+ */
+static void remove_lines(int from, int upto)
+{
+    int i;
+
+    for (i = from; i < upto; i++) {
+        edited_line(lines[i] -> n);
+        drop_line(lines[i]);
+        if (compact)
+            drop_packed(lines[i]);
+    }
+    memmove(lines + from, lines + upto, (line_count - upto) * sizeof(lego *));
+    line_count -= upto - from;
+    mend_lines(from);
+}
+
 /*
  *  Find a numbered line within 'program'.
  *  Note ALL siblings of 'program' are wNUMBEREDLINE, but nothing else is.
@@ -105,20 +332,50 @@ void erase_program(void)
  */
 lego *find_line(double lNum)
 {
-    lego *l;
-    for (l = program; l; l = l -> next)
-        if (l -> n == lNum) return l;
+    int i = line_index(lNum);
+
+    if (i < line_count && lines[i] -> n == lNum)
+        return lines[i];
     return NULL;
 }
 
 /*
- *  Look up and resolve line numbers prior to running.
+ *  Resolve one line reference, found within line 'where' (if not less
+ *  than zero). Returns true iff the line is missing.
+ */
+static int resolve(lego *l, double where)
+{
+    lego *find;
+
+    if (l -> n < 0)
+        l -> link = NULL;
+    else if (find = find_line(l -> n))
+        l -> link = find;
+    else {
+        flash('e');
+        outf("can't find line %.0f", l -> n);
+        if (where >= 0)
+            outf(" in %.0f", where);
+        outf("\n");
+        flash('n');
+        warn("~");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Look up and resolve line numbers prior to running, and bind each
+ *  variable reference to its storage slot. References within program
+ *  lines are added to 'refs'.
  *  Returns true iff line(s) are missing.
  *  Call with 'where' less than zero; it's the last wNUMBEREDLINE seen.
+ *  Statements after an immediate LOAD get -2: their variables are bound,
+ *  but their line references wait until the new program is in.
  */
 int link(lego *l, double where)
 {
-    lego *find;
+    line_ref *r;
     int i, bad = 0;
 
     /* visit 'l' and its siblings */
@@ -129,33 +386,92 @@ int link(lego *l, double where)
             where = l -> n;
 
         /* visit children of 'l' */
-        for (i = 0; i<max_args; i++)
+        for (i = 0; i<l -> args; i++)
             bad += link(l -> a[i], where);
 
-        /* only line references need linked */
+        if (l -> what == wLOAD && where == -1) {
+            bad += link(l -> next, -2);
+            break;
+        }
+
+        /* variables are bound to a slot */
+        if (l -> what == wNUMVAR || l -> what == wSTRVAR) {
+            l -> link = bind_var(l -> s, l -> what == wSTRVAR);
+            continue;
+        }
+
+        /* and line references are linked */
         if (l -> what != wLINENUM)
             continue;
 
         /* do the link */
-        if (l -> n < 0)
-            l -> link = NULL;
-        else if (find = find_line(l -> n))
-            l -> link = find;
-        else {
-            ++bad;
-            flash('e');
-            printf("can't find line %.0f", l -> n);
-            if (where >= 0)
-                printf(" in %.0f", where);
-            printf("\n");
-            flash('n');
-            warn("~");
+        if (where == -2)
+            continue;
+        bad += resolve(l, where);
+        if (where >= 0) {
+            r = append((void **) &refs, &ref_count, &ref_room, sizeof(line_ref));
+            r -> ref = l;
+            r -> from = where;
         }
     }
 
     return bad;
 }
 
+/*
+ *  Compare line numbers for qsort() and bsearch().
+ */
+static int by_number(const void *a, const void *b)
+{
+    double x = *(double *) a, y = *(double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Bring the program's linkage up to date. Only lines edited since
+ *  the last time, and references to those lines, need any work.
+ *  Returns true iff line(s) are missing.
+ */
+static int link_program(void)
+{
+    int i, j, bad = 0;
+    lego *l;
+
+    if (relink_all) {
+        ref_count = edit_count = 0;
+        bad = link(program, -1);
+        goto done;
+    }
+
+    qsort(edited, edit_count, sizeof(double), by_number);
+
+    /* Forget references from edited lines, and fix those to them. */
+    for (i = j = 0; i < ref_count; i++) {
+        if (bsearch(&refs[i].from, edited, edit_count, sizeof(double),
+                by_number))
+            continue;
+        if (bsearch(&refs[i].ref -> n, edited, edit_count, sizeof(double),
+                by_number))
+            bad += resolve(refs[i].ref, refs[i].from);
+        refs[j++] = refs[i];
+    }
+    ref_count = j;
+
+    /* Link the edited lines that still exist. */
+    for (i = 0; i < edit_count; i++)
+        if ((i == 0 || edited[i] != edited[i - 1])
+                && (l = find_line(edited[i])))
+            bad += link(l -> a[0], l -> n);
+    edit_count = 0;
+
+done:
+    /* After trouble, don't trust any of it next time. */
+    relink_all = !!bad;
+    linked_gen = bad ? -1 : program_gen;
+    return bad;
+}
+
 /*
  *  Modify all line links (GOTO ___, RESTORE ___, GOSUB ___, etc.)
  *  within a given statement to point to a place that might not be where
@@ -168,6 +484,7 @@ void do_alter(lego *vi, lego *de)
 {
     int yes = 0;
 
+    unpack_program();
     for (vi = vi -> link, vi = vi -> a[0]; vi; vi = vi -> next)
         switch (vi -> what) {
             case wGOTO:
@@ -177,6 +494,8 @@ void do_alter(lego *vi, lego *de)
                 if (vi -> a[0])
                     yes = 1, vi -> a[0] -> link = de -> link;
         }
+    if (yes)
+        linked_gen = -1, relink_all = 1;    /* so RUN will undo this */
     if (!yes)
         warn("no alterations");
 }
@@ -187,52 +506,51 @@ void do_alter(lego *vi, lego *de)
  */
 void save_line(lego *l)
 {
-    lego **find, *bye;
+    int i;
 
     /*
-     *  Linkage and the program context will no longer be reliable.
+     *  Linkage, compiled code, and the program context will no longer
+     *  be reliable.
      */
     reset_program();
+    drop_trees();
+    zap(prog_code);
 
     /*
-     *  Find where the line goes in the linked list.
+     *  Find where the line goes in the index.
      */
-    for (find = &program; *find; find = &(*find) -> next)
-        if ((*find) -> n >= l -> n)
-            break;
+    i = line_index(l -> n);
 
     /*
-     *  If that line number exists already, remove and free it.
+     *  If that line number exists already, remove it.
      */
-    if (*find && (*find) -> n == l -> n) {
-        bye = *find;
-        *find = bye -> next;
-        bye -> next = NULL;
-        byeLego(bye);
-    }
+    if (i < line_count && lines[i] -> n == l -> n)
+        remove_lines(i, i + 1);
 
     /*
-     *  If nothing was deleted and 'l' has no code, user error. Free 'l'.
+     *  If nothing was deleted and 'l' has no code, user error.
      */
     else if (!l -> a[0]) {
         warn("no such line to delete");
-        goto l_bye;
+        return;
     }
 
     /*
-     *  If 'l' has code, add to the program.
+     *  If 'l' has code, add to the program, keeping its arena. Lines
+     *  are usually entered in order, so this is usually an append.
+     *  Otherwise 'l' goes with its arena once the caller is done.
      */
     if (l -> a[0]) {
-        l -> next = *find;
-        *find = l;
-        return;
+        if (compact)
+            l = pack_line(l);
+        append((void **) &lines, &line_count, &line_room, sizeof(lego *));
+        memmove(lines + i + 1, lines + i, (line_count - 1 - i) * sizeof(lego *));
+        lines[i] = l;
+        keep_line(l);
+        edited_line(l -> n);
+        l -> next = i + 1 < line_count ? lines[i + 1] : NULL;
+        mend_lines(i);
     }
-
-    /*
-     *  Otherwise, we need to free 'l' since it's not saved in a program.
-     */
-l_bye:
-    byeLego(l);
 }
 
 /*
@@ -240,15 +558,27 @@ l_bye:
  */
 void list(double vi, double de)
 {
-    int any = 0;
+    arena *was = lego_arena;
+    int any = 0, i;
     lego *l;
 
-    for (l = program; l; l = l -> next)
-        if ((vi < 0 || l -> n >= vi) && (de < 0 || l -> n <= de)) {
+    for (i = line_index(vi); i < line_count; i++) {
+        l = lines[i];
+        if (de >= 0 && l -> n > de)
+            break;
+        if (l -> a[0])
+            printLego(l);
+        else {                  /* compact, so list it from its tokens */
+            lego_arena = new_arena();
+            l -> a[0] = untokenize(l -> s);
             printLego(l);
-            printf("\n");
-            ++any;
+            l -> a[0] = NULL;
+            end_arena(lego_arena);
+            lego_arena = was;
         }
+        outf("\n");
+        ++any;
+    }
 
     if (!any && vi == de && vi >= 0)
         warn("no such line to list");
@@ -259,62 +589,206 @@ void list(double vi, double de)
  */
 void del(double vi, double de)
 {
-    int any = 0;
-    lego **l, *bye;
+    int any, from, upto;
 
-    for (l = &program; *l;) {
-        if ((vi < 0 || (*l) -> n >= vi) && (de < 0 || (*l) -> n <= de)) {
-            bye = *l;
-            *l = bye -> next;
-            bye -> next = NULL;
-            byeLego(bye);
-            ++any;
-        }
-        else
-            l = &(*l) -> next;
-    }
+    from = line_index(vi);
+    upto = de < 0 ? line_count : line_index(de);
+    if (upto < line_count && lines[upto] -> n == de)
+        ++upto;
+    any = upto > from;
+    if (any)
+        remove_lines(from, upto);
 
     if (!any && vi == de && vi >= 0)
         warn("no such line");
-    else
+    else {
         /*
-         *  Linkage and the program context are no longer reliable.
+         *  Linkage, compiled code, and the program context are no
+         *  longer reliable.
          */
         reset_program();
+        drop_trees();
+        zap(prog_code);
+    }
 }
 
 /*
- *  Execute the PRINT statement. Returns true iff errors.
+ *  Order loaded lines by number, then by where they were in the file.
  */
-int runPrint(lego *l)
+typedef struct loaded {
+    lego *l;
+    int row;
+} loaded;
+
+static int by_line_and_row(const void *a, const void *b)
 {
-    lego *loop;
-    computed q;
-    char *s;
+    const loaded *x = a, *y = b;
 
-    if (!l -> a[0]) printf("\n");
-    for (loop = l -> a[0]; loop; loop = loop -> next) {
-        q = evalloc(loop);
-        switch (q.what) {
-            case rString:
-                printf("%s", q.s);
-                for (s = q.s; *s; ++s)
-                    dirty = *s != '\n';
-                zap(q.s);
-                break;
-            case rNum:
-                printf(trunc(q.n) == q.n ? "%.0f" : "%f", q.n);
-                dirty = 1;
-                break;
-            case rExcept:
-                return 1;
+    if (x -> l -> n != y -> l -> n)
+        return x -> l -> n < y -> l -> n ? -1 : 1;
+    return x -> row - y -> row;
+}
+
+/*
+ *  Replace the program with one from a file, which is mapped into
+ *  memory whole. An image (see image.c) is rebuilt without parsing.
+ *  Text is parsed in one pass, and its lines are sorted and put in
+ *  place together, rather than each being saved as if typed. Trouble
+ *  is reported with the file's line numbers as it's found.
+ *  Returns true iff the file loaded cleanly.
+ */
+int load_file(char *name)
+{
+    struct stat st;
+    char *map = NULL, *text, *s, *eol;
+    long size;
+    int row, bad = 0, ok, i, j;
+    loaded *sort;
+    arena *was, *into;
+    FILE *f;
+    lego *l;
+
+    if (!(f = fopen(name, "rb"))) {
+        warn("can't open file");
+        return 0;
+    }
+    size = fstat(fileno(f), &st) ? -1 : st.st_size;
+    if (size > 0)
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    fclose(f);
+    if (size < 0 || map == MAP_FAILED) {
+        warn("can't read file");
+        return 0;
+    }
+
+    erase_program();
+    was = lego_arena;
+    lego_arena = into = new_arena();
+
+    if (is_image(map, size)) {
+        ok = load_image(map, size, &l);
+        munmap(map, size);
+        if (!ok) {
+            end_arena(lego_arena);
+            lego_arena = was;
+            return 0;
         }
-        if (!loop -> list_delim) {
-            printf(loop -> next ? " " : "\n");
-            dirty = !!loop -> next;
+        for (; l; l = l -> next)
+            *(lego **) append((void **) &lines, &line_count, &line_room,
+                sizeof(lego *)) = l;
+        goto install;
+    }
+
+    /* Text gets a copy the parser can chop into lines. */
+    text = getmem(size + 1);
+    if (size)
+        memcpy(text, map, size);
+    if (map)
+        munmap(map, size);
+
+    /* Parse every line, keeping those that are numbered. */
+    for (s = text, row = 1; s < text + size; s = eol + 1, ++row) {
+        if (!(eol = memchr(s, '\n', text + size - s)))
+            eol = text + size;
+        *eol = '\0';
+        if (eol > s && eol[-1] == '\r')
+            eol[-1] = '\0';
+
+        warning = NULL;
+        if (compact)
+            lego_arena = new_arena();   /* just until it's packed */
+        ok = command_line(&s, &l);
+        if (ok && l -> what != wNUMBEREDLINE) {
+            warn("need line number");
+            byeLego(l);
+            ok = 0;
+        }
+        if (warning) {
+            ++bad;
+            flash('e');
+            outf("%s line %d: %s\n", name, row, warning);
+            flash('n');
+        }
+        if (ok) {
+            if (compact)
+                l = pack_line(l);
+            else
+                fold(l);
+            *(lego **) append((void **) &lines, &line_count, &line_room,
+                sizeof(lego *)) = l;
+        }
+        if (compact) {
+            end_arena(lego_arena);
+            lego_arena = into;
         }
     }
-    return 0;
+    zap(text);
+
+    /*
+     *  Files are usually in order already. If not, sort them, with
+     *  the last of any lines having the same number winning out.
+     */
+    for (i = 1; i < line_count; i++)
+        if (lines[i - 1] -> n >= lines[i] -> n)
+            break;
+    if (i < line_count) {
+        sort = getmem(line_count * sizeof(loaded));
+        for (i = 0; i < line_count; i++)
+            sort[i].l = lines[i], sort[i].row = i;
+        qsort(sort, line_count, sizeof(loaded), by_line_and_row);
+        for (i = 0; i < line_count; i++)
+            lines[i] = sort[i].l;
+        zap(sort);
+    }
+
+    /* Drop replaced lines, and those with no code (deletions). */
+    for (i = j = 0; i < line_count; i++) {
+        l = lines[i];
+        if (i + 1 < line_count && lines[i + 1] -> n == l -> n
+                || !l -> a[0] && (!l -> s || !str_len(l -> s))) {
+            if (compact && !l -> a[0])
+                drop_packed(l);
+            else
+                byeLego(l);
+        }
+        else
+            lines[j++] = l;
+    }
+    line_count = j;
+
+    /* Make the list agree with the index; the lines keep the arena. */
+install:
+    for (i = 0; i < line_count; i++)
+        if (compact && lines[i] -> a[0])
+            lines[i] = pack_line(lines[i]);
+    for (i = 0; i < line_count; i++) {
+        lines[i] -> next = i + 1 < line_count ? lines[i + 1] : NULL;
+        keep_line(lines[i]);
+    }
+    end_arena(lego_arena);
+    lego_arena = was;
+    program = line_count ? lines[0] : NULL;
+    ++program_gen;
+    reset_program();
+
+    warning = NULL;
+    if (bad)
+        warn("~");          /* already reported */
+    return !bad;
+}
+
+/*
+ *  Link and compile the program, unless it's unchanged since the last
+ *  time. Returns true iff the program is ready to run.
+ */
+int compile_program(void)
+{
+    unpack_program();
+    if (linked_gen != program_gen && link_program())
+        return 0;
+    if (!prog_code)
+        prog_code = compile(program);
+    return !!prog_code;
 }
 
 /*
@@ -323,7 +797,7 @@ int runPrint(lego *l)
 void byItself(void)
 {
     if (!dirty) return;
-    printf("\n");
+    outf("\n");
     dirty = 0;
 }
 
@@ -336,11 +810,23 @@ void advise(char *msg, int ran, double lNum)
         return;             /* message(s) issued by linker */
     byItself();
     flash('e');
-    printf("%s", msg);
+    outf("%s", msg);
     if (ran && lNum >= 0)
-        printf(" in %.0f", lNum);
-    printf("\n");
+        outf(" in %.0f", lNum);
+    outf("\n");
     flash('n');
+    flush();
+}
+
+/*
+ *  Bind the variables in a line's DATA statements, for READ from a
+ *  program that isn't linked (as after editing it).
+ */
+static void bind_data(lego *l)
+{
+    for (; l; l = l -> next)
+        if (l -> what == wDATA)
+            link(l -> a[0], -1);
 }
 
 /*
@@ -367,6 +853,9 @@ requeue:
 
     /* Find statements within numbered lines. */
     if (prog_con.data_line) {
+        unpack_program();
+        if (linked_gen != program_gen)
+            bind_data(prog_con.data_line -> a[0]);
         prog_con.data_stmt = prog_con.data_line -> a[0];
         prog_con.data_line = prog_con.data_line -> next;
         goto requeue;
@@ -382,41 +871,46 @@ void get_inputs(lego *l, char *prompt)
 {
     char *s;
     lego *redo_from = l, *var;
+    arena *was = lego_arena;
+
+    /* Items typed are parsed into legos that go when we're done. */
+    lego_arena = new_arena();
 
 redo_from_start:
     l = redo_from;
     s = NULL;
-    printf("%s", prompt);
+    outf("%s", prompt);
     s = read_line();
 
     while (l) {
         if (!s) {           /* Ctrl-C restarts line; Ctrl-D aborts program */
             ctrl_c = 1;
-            return;
+            break;
         }
         if (l -> what == wSTRVAR) {
             /* even empty strings succeed */
             if (!str_lit(&s, &var))
                 unquoted_str_lit(&s, &var);
-            set_var(l -> s, var -> s, 0);
+            give_var(l -> link, var -> s);
+            var -> s = NULL;
         }
         else {
             /* empty numbers keep prompting */
             if (nothingMore(&s)) {
-                printf("? ");
+                outf("? ");
                 s = read_line();
                 continue;
             }
             if (!num_lit(&s, &var))
                 goto oops;
-            set_var(l -> s, NULL, var -> n);
+            set_var(l -> link, NULL, var -> n);
         }
         byeLego(var);
         l = l -> next;
         if (!l)
             break;
         if (nothingMore(&s)) {
-            printf("? ");
+            outf("? ");
             s = read_line();
         }
         else if (symbol(&s, ","))
@@ -426,11 +920,13 @@ redo_from_start:
     }
     if (s && !nothingMore(&s))
         goto oops;                  /* too many items input */
+    end_arena(lego_arena);
+    lego_arena = was;
     return;
 
 oops:
     flash('e');
-    puts("redo from start");
+    outf("redo from start\n");
     flash('n');
     goto redo_from_start;
 }
@@ -438,338 +934,592 @@ oops:
 /*
  *  This terminates nested FOR ... NEXT loops.
  */
-void expire_next_stack(x_con *c, char *nVar, int inclusive)
+void expire_next_stack(x_con *c, varDB *var, int inclusive)
 {
-    next_stack *ns;
-    int i = !!inclusive;
-
-    /* Count how many will be removed. */
-    for (ns = c -> next_to; ns; ns = ns -> next, ++i)
-        if (!nVar || !strcmp(ns -> nVar, nVar))
-            goto yes;
-    return;
+    int i;
 
-    /* Remove everything up to and maybe including nVar */
-yes:
-    while (i--) {
-        ns = c -> next_to -> next;
-        zap(c -> next_to -> nVar);
-        zap(c -> next_to);
-        c -> next_to = ns;
-    }
+    /* Remove everything above and maybe including var */
+    for (i = c -> nexts; i--; )
+        if (!var || c -> next_to[i].var == var) {
+            c -> nexts = inclusive ? i : i + 1;
+            return;
+        }
 }
 
 /*
- *  Advance /one/ step in whatever code we have.
- *  c -> code, line, stmt can be one and the same for immediate commands,
- *  in which case 'line' won't have a number.
- *
- *  This routine is agnostic as to whether a step /should/ be taken; e.g.,
- *  it doesn't think about whether a program is running or stopped. It
- *  merely proceeds one step. If the program has ended, 'line' and 'stmt'
- *  are NULL. It does not initialize 'line' or 'stmt' prior to execution;
- *  the caller needs to do this.
- *
- *  This routine does not catch typed program lines ("10 CLS"); the
- *  caller has already filtered these out. Nor does it handle DEL statements,
- *  as these also modify the program and would invalidate several invariants.
- *
- *  An integer "honey do" is returned to inform the caller of any action
- *  it may need to take.
+ *  Execute the READ statement. Returns true iff errors.
  */
-int single_step(x_con *c)
+int runRead(lego *dest)
 {
-    lego *l, *dest, *datum;
+    lego *datum;
     computed q;
-    ret_stack *ret_to;
-    next_stack *next_to;
-    double xyz[4];
-    int i;
-    char *s;
-
-    /* Get the current statement in 'l'. */
-    while (!c -> stmt) {
-        if (!c -> line)
-            return wEND;
-        c -> stmt = c -> line = c -> line -> next;
-    }
-
-    /* Default assumption: next statement is its sibling. */
-    l = c -> stmt;
-    c -> stmt = c -> stmt -> next;
-
-    switch (l -> what) {
-
-        case wRUN:
-            start_at = l -> a[0] ? l -> a[0] -> link : NULL;
-        case wNEW:
-        case wEND:
-        case wSTOP:
-        case wCONT:
-            /* Caller will handle these context adjustments. */
-            return l -> what;
-
-        case wNUMBEREDLINE:
-            /* Next statement is child of this one. */
-            c -> lNum = l -> n;
-            c -> stmt = l -> a[0];
-            break;
-
-        case wLIST:
-            list(l -> a[0] -> n, l -> a[0] -> next -> n);
-            break;
+    double n;
 
-        case wDEL:
-            if (c == &prog_con) {
-                warn("attempt to modify running program");
-                return wERROR;
-            }
-            del(l -> a[0] -> n, l -> a[0] -> next -> n);
-            break;
+    for (; dest; dest = dest -> next) {
 
-        case wCLS:
-            flash('c');
-            break;
+        /* Get item from next available DATA */
+        datum = get_next_data();
+        if (!datum) {
+            warn("out of data");
+            return 1;
+        }
 
-        case wPRINT:
-            if (runPrint(l))
-                return wERROR;          /* exception in evaluation tree */
-            break;
+        /* Our DATA is "dynamic" and can contain expressions! */
+        if (string_valued(datum -> what) != (dest -> what == wSTRVAR)) {
+            warn("type mismatch");
+            return 1;
+        }
 
-        case wIF:
-            q = evalloc(l -> a[0]);
+        /* Read string variable. */
+        if (dest -> what == wSTRVAR) {
+            q = evalloc(datum);
             if (q.what == rExcept)
-                return wERROR;
-            if (q.n) {
-                if (l -> a[1])
-                    c -> stmt = l -> a[1];
-            }
-            else if (l -> a[2])
-                c -> stmt = l -> a[2];
-            zap(q.s);                   /* parser ensures this isn't needed */
-            break;
+                return 1;
+            give_var(dest -> link, q.s);
+        }
 
-        case wLET:
-            q = evalloc(l -> a[1]);
-            if (q.what == rExcept)
-                return wERROR;
-            if (l -> a[0] -> what == wSTRVAR)
-                set_var(l -> a[0] -> s, q.s, 0);
-            else if (l -> a[0] -> what == wNUMVAR)
-                set_var(l -> a[0] -> s, NULL, q.n);
-            else {
-                warn("assertion failed (check parser)");
-                return wERROR;
-            }
-            zap(q.s);
-            break;
+        /* Read numeric variable. */
+        else {
+            if (!evalnum(datum, &n))
+                return 1;
+            set_var(dest -> link, NULL, n);
+        }
+    }
+    return 0;
+}
 
-        case wONGOTO:
-            q = evalloc(l -> a[0]);
-            if (q.what == rExcept)
-                return wERROR;
-            for (i = 1, dest = l -> a[1]; dest; ++i, dest = dest -> next)
-                if (i == q.n)
-                    goto like_GOTO;
-            break;
+/*
+ *  Run compiled code from c -> pc until something needs the caller's
+ *  attention. Code is direct threaded: every opcode is the address of
+ *  the label below that implements it, so each instruction ends by
+ *  jumping straight to the next one rather than returning to a loop.
+ *
+ *  Expression values live on the numeric and string stacks, which are
+ *  always empty between statements; so c -> pc is all that has to be
+ *  saved when we return.
+ *
+ *  This routine doesn't think about whether a program /should/ be
+ *  running; it merely proceeds. Nor does it catch typed program lines
+ *  ("10 CLS"), which the caller has already filtered out.
+ *
+ *  An integer "honey do" is returned to inform the caller of any action
+ *  it may need to take. Zero means a break (CTRL-C) was noticed.
+ *
+ *  Called with NULL, this only sets up 'labels' for the compiler.
+ */
+int execute(x_con *c)
+{
+    static void *table[END_VM_GUYS] = {
+        [wNEGATE] = &&negate_, [wNOT] = &&not_, [wPOWER] = &&power_,
+        [wMUL] = &&mul_, [wDIV] = &&div_, [wADD] = &&add_, [wSUB] = &&sub_,
+        [wIDIV] = &&idiv_, [wMOD] = &&mod_, [wGT] = &&gt_, [wGE] = &&ge_,
+        [wLT] = &&lt_, [wLE] = &&le_, [wEQ] = &&eq_, [wNE] = &&ne_,
+        [wAND] = &&and_, [wOR] = &&or_, [wXOR] = &&xor_, [wEQV] = &&eqv_,
+        [wIMP] = &&imp_, [wNAND] = &&nand_, [wNOR] = &&nor_,
+        [wCAT] = &&cat_, [wABS] = &&abs_, [wASC] = &&asc_,
+        [wATAN] = &&atan_, [wCHR] = &&chr_, [wCOS] = &&cos_,
+        [wEXP] = &&exp_, [wFIX] = &&fix_, [wINSTR] = &&instr_,
+        [wINT] = &&int_, [wLEFT] = &&left_, [wLEN] = &&len_,
+        [wLOG] = &&log_, [wMID] = &&mid_, [wRIGHT] = &&right_,
+        [wRND] = &&rnd_, [wSGN] = &&sgn_, [wSIN] = &&sin_,
+        [wSPACE] = &&space_, [wSQRT] = &&sqrt_, [wSTR] = &&str_,
+        [wSTRING] = &&string_, [wTAN] = &&tan_, [wVAL] = &&val_,
+        [wNEW] = &&new_, [wEND] = &&end_, [wSTOP] = &&stop_,
+        [wCONT] = &&cont_, [wRETURN] = &&return_, [wCLS] = &&cls_,
+        [wLIST] = &&list_, [wDEL] = &&del_, [wGOSUB] = &&gosub_,
+        [wGOTO] = &&goto_, [wRUN] = &&run_, [wRESTORE] = &&restore_,
+        [wONGOTO] = &&ongoto_, [wONGOSUB] = &&ongosub_, [wFOR] = &&for_,
+        [wNEXT] = &&next_, [wREAD] = &&read_, [wPRINT] = &&print_,
+        [wINPUT] = &&input_,
+        [wLINEINPUT] = &&lineinput_, [wALTER] = &&alter_,
+        [wONALTER] = &&onalter_, [wDISASM] = &&disasm_, [wLOAD] = &&load_,
+        [wSAVE] = &&save_, [wCLEAR] = &&clear_, [wFRE] = &&fre_,
+        [wFREMEM] = &&fremem_, [wMEM] = &&mem_,
+        [wSTRLIT] = &&strlit_, [wSTRVAR] = &&strvar_,
+        [wNUMLIT] = &&numlit_, [wNUMVAR] = &&numvar_,
+        [wNUMBEREDLINE] = &&numberedline_, [wJUMP] = &&jump_,
+        [wJFALSE] = &&jfalse_, [wSETNUM] = &&setnum_,
+        [wSETSTR] = &&setstr_, [wPRINTNUM] = &&printnum_,
+        [wPRINTSTR] = &&printstr_, [wPRINTSEP] = &&printsep_,
+        [wHALT] = &&halt_, [wDUP] = &&dup_, [wCATN] = &&catn_,
+        [wAPPEND] = &&append_,
+    };
+    code *pc;
+    int deep = c ? c -> deep + 1 : 1;
+    double ns[deep], *np = ns;          /* numeric stack */
+    char *ss[deep], **sp = ss;          /* string stack */
+    computed q, x = { 0 }, y = { 0 }, z = { 0 };
+    varDB *v;
+    next_frame *next_to;
+    lego *dest;
+    int i, what, len;
+    char *s;
 
-        case wGOTO:
-            dest = l -> a[0];
-like_GOTO:
-            if (c != &prog_con) {       /* immediate context? */
-                start_at = dest -> link;
-                return l -> what;
-            }
-            c -> stmt = c -> line = dest -> link;
-            break;
+#define go(words) { pc += (words); goto *pc -> op; }
 
-        case wREM:
-            break;          /* no-op */
- 
-        case wGOSUB:
-            if (c != &prog_con) {       /* immediate context? */
-                /*
-                 *  Complex enough to skip implementing because:
-                 *  GOSUB and RETURN would both switch context.
-                 */
-                warn("immediate GOSUB not supported");
-                break;
-            }
-            dest = l -> a[0];
-like_GOSUB:
-            ret_to = getmem(sizeof(ret_stack));
-            ret_to -> line = c -> line, ret_to -> stmt = c -> stmt;
-            ret_to -> running = c == &prog_con;
-            ret_to -> next = c -> ret_to;
-            c -> ret_to = ret_to;
-            c -> stmt = c -> line = dest -> link;
-            break;
+    if (!c) {
+        labels = table;
+        return 0;
+    }
+    if (!(pc = c -> pc))
+        return wEND;
+    go(0);
 
-        case wONGOSUB:
-            if (c != &prog_con) {       /* immediate context? */
-                warn("immediate ON .. GOSUB not supported");
-                break;
-            }
-            q = evalloc(l -> a[0]);
-            if (q.what == rExcept)
-                return wERROR;
-            for (i = 1, dest = l -> a[1]; dest; ++i, dest = dest -> next)
-                if (i == q.n)
-                    goto like_GOSUB;
-            break;
+    /*
+     *  Values and arithmetic.
+     */
+numlit_:    *np++ = pc[1].n; go(2);
+strlit_:    *sp++ = share_str(pc[1].s); go(2);
+numvar_:
+    if (pc[1].v -> era != vars_era)
+        goto no_such_variable;
+    *np++ = pc[1].v -> n;
+    go(2);
+strvar_:
+    if (pc[1].v -> era != vars_era)
+        goto no_such_variable;
+    *sp++ = share_str(pc[1].v -> s);
+    go(2);
+no_such_variable:
+    warn("no such variable");
+    goto except;
+
+dup_:       *np = np[-1]; ++np; go(1);
+negate_:    np[-1] = -np[-1]; go(1);
+not_:       np[-1] = !np[-1]; go(1);
+power_:     --np; np[-1] = pow(np[-1], *np); go(1);
+mul_:       --np; np[-1] *= *np; go(1);
+div_:       --np; np[-1] /= *np; go(1);
+add_:       --np; np[-1] += *np; go(1);
+sub_:       --np; np[-1] -= *np; go(1);
+gt_:        --np; np[-1] = -(np[-1] > *np); go(1);
+ge_:        --np; np[-1] = -(np[-1] >= *np); go(1);
+lt_:        --np; np[-1] = -(np[-1] < *np); go(1);
+le_:        --np; np[-1] = -(np[-1] <= *np); go(1);
+eq_:        --np; np[-1] = -(np[-1] == *np); go(1);
+ne_:        --np; np[-1] = -(np[-1] != *np); go(1);
+
+idiv_:      what = wIDIV; goto divmod_;
+mod_:       what = wMOD; goto divmod_;
+divmod_:
+    --np;
+    if (!divmod(np[-1], *np, what, &np[-1]))
+        goto except;
+    go(1);
+
+and_:       what = wAND; goto logic_;
+or_:        what = wOR; goto logic_;
+xor_:       what = wXOR; goto logic_;
+eqv_:       what = wEQV; goto logic_;
+imp_:       what = wIMP; goto logic_;
+nand_:      what = wNAND; goto logic_;
+nor_:       what = wNOR; goto logic_;
+logic_:
+    --np;
+    if (!boolean_logic(np[-1], *np, what, &np[-1]))
+        goto except;
+    go(1);
+
+abs_:       np[-1] = fabs(np[-1]); go(1);
+atan_:      np[-1] = atan(np[-1]); go(1);
+cos_:       np[-1] = cos(np[-1]); go(1);
+exp_:       np[-1] = exp(np[-1]); go(1);
+fix_:       np[-1] = trunc(np[-1]); go(1);
+int_:       np[-1] = floor(np[-1]); go(1);
+log_:       np[-1] = log(np[-1]); go(1);
+rnd_:       np[-1] = csprng(np[-1]); go(1);
+sgn_:       np[-1] = (np[-1] > 0) - (np[-1] < 0); go(1);
+sin_:       np[-1] = sin(np[-1]); go(1);
+sqrt_:      np[-1] = sqrt(np[-1]); go(1);
+tan_:       np[-1] = tan(np[-1]); go(1);
 
-        case wRETURN:
-            /*
-             *  Immediate RETURN is supported even though immediate
-             *  GOSUB isn't, as the former is not complex.
-             */
-            if (!prog_con.ret_to) {
-                warn("RETURN without GOSUB");
-                break;
-            }
-            ret_to = prog_con.ret_to;
-            prog_con.line = ret_to -> line, prog_con.stmt = ret_to -> stmt;
-            prog_con.ret_to = ret_to -> next;
-            zap(ret_to);
-            return wRETURN;
-
-        case wRESTORE:
-            prog_con.data_line = l -> a[0] ? l -> a[0] -> link : program;
-            prog_con.data_stmt = prog_con.data_datum = NULL;
-            break;
+    /*
+     *  Functions involving strings are left to builtin().
+     */
+asc_:       what = wASC; x.s = *--sp; goto builtin_;
+chr_:       what = wCHR; x.n = *--np; goto builtin_;
+instr_:     what = wINSTR; z.s = *--sp; y.s = *--sp; x.n = *--np;
+            goto builtin_;
+left_:      what = wLEFT; y.n = *--np; x.s = *--sp; goto builtin_;
+len_:       what = wLEN; x.s = *--sp; goto builtin_;
+fre_:       what = wFRE; x.s = *--sp; goto builtin_;
+fremem_:    what = wFREMEM; x.n = *--np; goto builtin_;
+mid_:       what = wMID; z.n = *--np; y.n = *--np; x.s = *--sp;
+            goto builtin_;
+right_:     what = wRIGHT; y.n = *--np; x.s = *--sp; goto builtin_;
+space_:     what = wSPACE; x.n = *--np; goto builtin_;
+str_:       what = wSTR; x.n = *--np; goto builtin_;
+string_:    what = wSTRING; y.s = *--sp; x.n = *--np; goto builtin_;
+val_:       what = wVAL; x.s = *--sp; goto builtin_;
+cat_:       what = wCAT; y.s = *--sp; x.s = *--sp; goto builtin_;
+catn_:
+    for (i = pc[1].i, len = 0; i; i--)
+        len += str_len(sp[-i]);
+    s = make_str(len);
+    for (i = pc[1].i, len = 0; i; i--) {
+        memcpy(s + len, sp[-i], str_len(sp[-i]));
+        len += str_len(sp[-i]);
+        zap_str(sp[-i]);
+    }
+    sp -= pc[1].i;
+    *sp++ = s;
+    go(2);
+builtin_:
+    q = builtin(what, x, y, z);
+    zap_str(x.s);
+    zap_str(y.s);
+    zap_str(z.s);
+    if (q.what == rExcept)
+        goto except;
+    if (q.what == rString)
+        *sp++ = q.s;
+    else
+        *np++ = q.n;
+    go(1);
 
-        case wDATA:
-            break;          /* not executable */
-
-        case wREAD:
-            for (dest = l -> a[0]; dest; dest = dest -> next) {
-
-                /* Get item from next available DATA */
-                datum = get_next_data();
-                if (!datum) {
-                    warn("out of data");
-                    break;
-                }
-
-                /* Our DATA is "dynamic" and can contain expressions! */
-                q = evalloc(datum);
-                if (q.what == rExcept)
-                    return wERROR;
-
-                /* Read string variable. */
-                if (dest -> what == wSTRVAR) {
-                    if (q.what != rString)
-                        warn("type mismatch");
-                    else
-                        set_var(dest -> s, q.s, 0);
-                    zap(q.s);
-                }
-
-                /* Read numeric variable. */
-                else {
-                    if (q.what != rNum) {
-                        warn("type mismatch");
-                        break;
-                    }
-                    set_var(dest -> s, NULL, q.n);
-                }
-            }
+    /*
+     *  Statements.
+     */
+numberedline_:
+    if (ctrl_c)
+        goto pause;
+    c -> lNum = pc[1].l -> n;
+    go(2);
+
+setnum_:
+    pc[1].v -> n = *--np;
+    pc[1].v -> era = vars_era;
+    go(2);
+
+append_:
+    v = pc[1].v;
+    if (v -> era != vars_era)
+        goto no_such_variable;
+    s = v -> s;
+    v -> s = NULL;          /* so collecting won't move it meanwhile */
+    sp -= pc[2].i;
+    for (i=0; i<pc[2].i; i++) {
+        s = append_str(s, sp[i], str_len(sp[i]));
+        zap_str(sp[i]);
+    }
+    v -> s = s;
+    go(3);
+
+setstr_:
+    --sp;
+    give_var(pc[1].v, *sp);
+    go(2);
+
+printnum_:
+    --np;
+    out_num(*np);
+    dirty = 1;
+    go(1);
+
+printstr_:
+    --sp;
+    if (i = str_len(*sp)) {
+        out_mem(*sp, i);
+        dirty = (*sp)[i - 1] != '\n';
+    }
+    zap_str(*sp);
+    go(1);
+
+print_:
+    outf("\n");
+    go(1);
+
+printsep_:
+    outf(pc[1].i ? " " : "\n");
+    dirty = pc[1].i;
+    go(2);
+
+jump_:
+    pc = pc[1].j;
+    go(0);
+
+jfalse_:
+    if (*--np)
+        go(2);
+    pc = pc[1].j;
+    go(0);
+
+    /* Caller will handle these context adjustments. */
+run_:
+    start_at = pc[1].l ? pc[1].l -> link : NULL;
+    what = wRUN;
+    pc += 2;
+    goto honey_do;
+new_:       what = wNEW; ++pc; goto honey_do;
+end_:       what = wEND; ++pc; goto honey_do;
+stop_:      what = wSTOP; ++pc; goto honey_do;
+cont_:      what = wCONT; ++pc; goto honey_do;
+halt_:      what = wEND; goto honey_do;
+
+list_:
+    list(pc[1].l -> n, pc[1].l -> next -> n);
+    go(2);
+
+del_:
+    if (c == &prog_con) {
+        warn("attempt to modify running program");
+        goto except;
+    }
+    del(pc[1].l -> n, pc[1].l -> next -> n);
+    go(2);
+
+load_:
+    s = *--sp;
+    if (c == &prog_con)
+        warn("attempt to modify running program");
+    else if (load_file(s))
+        link(pc[1].l -> next, -1);      /* rest of the line */
+    zap_str(s);
+    if (warning)
+        goto except;
+    go(2);
+
+save_:
+    s = *--sp;
+    i = !trees;
+    unpack_program();
+    save_image(s, lines, line_count);
+    if (i)
+        drop_trees();
+    zap_str(s);
+    if (warning)
+        goto except;
+    go(1);
+
+clear_:
+    if (pc[1].i) {              /* CLEAR n */
+        --np;
+        if (*np != trunc(*np) || *np < 0 || *np > 1 << 30) {
+            warn("need non-negative integer");
+            goto except;
+        }
+    }
+    clear_vars();
+    if (pc[1].i && !str_space(*np))
+        goto except;
+    go(2);
+
+disasm_:
+    if (!compile_program())
+        goto except;
+    disassemble(prog_code, pc[1].l -> n, pc[1].l -> next -> n);
+    go(2);
+
+cls_:
+    flash('c');
+    go(1);
+
+mem_:
+    mem_report();
+    go(1);
+
+ongoto_:
+    --np;
+    for (i = 1, dest = pc[1].l; dest; ++i, dest = dest -> next)
+        if (i == *np)
             break;
+    pc += 2;
+    if (dest)
+        goto like_goto;
+    go(0);
+
+goto_:
+    dest = pc[1].l;
+    pc += 2;
+like_goto:
+    if (c != &prog_con) {       /* immediate context? */
+        start_at = dest -> link;
+        what = wGOTO;
+        goto honey_do;
+    }
+    pc = ((lego *) dest -> link) -> link;
+    go(0);
 
-        case wINPUT:
-            get_inputs(l -> a[1], l -> a[0] ? l -> a[0] -> s : "? ");
+gosub_:
+    if (c != &prog_con) {       /* immediate context? */
+        /*
+         *  Complex enough to skip implementing because:
+         *  GOSUB and RETURN would both switch context.
+         */
+        warn("immediate GOSUB not supported");
+        goto except;
+    }
+    dest = pc[1].l;
+    pc += 2;
+like_gosub:
+    if (!stack_room((void **) &c -> ret_to, &c -> ret_room, c -> rets,
+            sizeof(code *)))
+        goto except;
+    c -> ret_to[c -> rets++] = pc;
+    pc = ((lego *) dest -> link) -> link;
+    go(0);
+
+ongosub_:
+    --np;
+    if (c != &prog_con) {       /* immediate context? */
+        warn("immediate ON .. GOSUB not supported");
+        goto except;
+    }
+    for (i = 1, dest = pc[1].l; dest; ++i, dest = dest -> next)
+        if (i == *np)
             break;
+    pc += 2;
+    if (dest)
+        goto like_gosub;
+    go(0);
 
-        case wLINEINPUT:
-            s = read_line();
-            if (s)
-                set_var(l -> a[0] -> s, s, 0);
-            else
-                ctrl_c = 1;
-            break;
+return_:
+    /*
+     *  Immediate RETURN is supported even though immediate
+     *  GOSUB isn't, as the former is not complex.
+     */
+    if (!prog_con.rets) {
+        warn("RETURN without GOSUB");
+        goto except;
+    }
+    if (c != &prog_con) {
+        prog_con.pc = prog_con.ret_to[--prog_con.rets];
+        what = wRETURN;
+        ++pc;
+        goto honey_do;
+    }
+    pc = c -> ret_to[--c -> rets];
+    go(0);
+
+restore_:
+    prog_con.data_line = pc[1].l ? pc[1].l -> link : program;
+    prog_con.data_stmt = prog_con.data_datum = NULL;
+    go(2);
+
+read_:
+    if (runRead(pc[1].l))
+        goto except;
+    go(2);
+
+input_:
+    get_inputs(pc[2].l, pc[1].s);
+    pc += 3;
+    if (ctrl_c)
+        goto pause;
+    go(0);
+
+lineinput_:
+    s = read_line();
+    if (s)
+        give_var(pc[1].v, copySubstring(s, NULL));
+    else
+        ctrl_c = 1;
+    pc += 2;
+    if (ctrl_c)
+        goto pause;
+    go(0);
 
-        case wFOR:
-            /*
-             *  FOR and NEXT do not support context switching or
-             *  play sanely with GOSUB and RETURN.
-             *  Begin by evaluating the numeric parameters.
-             */
-            for (i=1; i<4; i++) {
-                if (!l -> a[i]) {       /* i == 3 might have no STEP */
-                    xyz[i] = 1;
-                    continue;
-                }
-                q = evalloc(l -> a[i]);
-                if (q.what != rNum)
-                    return wERROR;
-                xyz[i] = q.n;
-            }
+for_:
+    /*
+     *  FOR and NEXT do not support context switching or
+     *  play sanely with GOSUB and RETURN.
+     *
+     *  If we're already looping on this variable, presume
+     *  the old loop (and any under it) to be defunct.
+     *  Then save new loop information and variable starting value.
+     */
+    np -= 3;
+    expire_next_stack(c, pc[1].v, 1);
+    if (!stack_room((void **) &c -> next_to, &c -> next_room, c -> nexts,
+            sizeof(next_frame)))
+        goto except;
+    next_to = &c -> next_to[c -> nexts++];
+    next_to -> var = pc[1].v;
+    next_to -> de = np[2] ? np[1] : NAN;    /* STEP 0 goes forever */
+    next_to -> step = np[2];
+    next_to -> up = np[2] > 0;
+    next_to -> pc = pc + 2;
+    set_var(pc[1].v, NULL, np[0]);
+    go(2);
+
+next_:
+    /*
+     *  Usually this NEXT belongs to the innermost loop. If not, any
+     *  loops within the one it belongs to are abandoned.
+     */
+    v = pc[1].v;
+    next_to = c -> nexts ? &c -> next_to[c -> nexts - 1] : NULL;
+    if (!next_to || v && v != next_to -> var) {
+        expire_next_stack(c, v, 0);
+        next_to = c -> nexts ? &c -> next_to[c -> nexts - 1] : NULL;
+        if (!next_to || v && v != next_to -> var) {
+            warn("NEXT without FOR");
+            goto except;
+        }
+    }
 
-            /*  If we're already looping on this variable, presume
-             *  the old loop (and any under it) to be defunct.
-             *  Then save new loop information and variable starting value.
-             */
-            expire_next_stack(c, l -> a[0] -> s, 1);
-            next_to = getmem(sizeof(next_stack));
-            next_to -> nVar = copySubstring(l -> a[0] -> s, NULL);
-            next_to -> vi = xyz[1];
-            next_to -> de = xyz[2];
-            next_to -> step = xyz[3];
-            next_to -> line = c -> line;
-            next_to -> stmt = c -> stmt;
-            next_to -> next = c -> next_to;
-            c -> next_to = next_to;
-            set_var(l -> a[0] -> s, NULL, xyz[1]);
-            break;
+    v = next_to -> var;
+    q.n = v -> n + next_to -> step;
+    if (next_to -> up ? q.n > next_to -> de : q.n < next_to -> de) {
 
-        case wNEXT:
-            s = l -> a[0] ? l -> a[0] -> s : NULL;
-            expire_next_stack(c, s, 0);
-            next_to = c -> next_to;
-            if (!next_to || s && strcmp(s, next_to -> nVar)) {
-                warn("NEXT without FOR");
-                break;
-            }
-            q.n = num_from_name_hack(next_to -> nVar);
-            q.n += next_to -> step;
-            if (   next_to -> step > 0 && q.n > next_to -> de
-                || next_to -> step < 0 && q.n < next_to -> de) {
-
-                /* Loop has run its course. There is no NEXT. */
-                zap(next_to -> nVar)
-                c -> next_to = next_to -> next;
-                zap(next_to);
-                break;
-            }
+        /* Loop has run its course. There is no NEXT. */
+        --c -> nexts;
+        go(2);
+    }
 
-            /* Adjust variable and return to top of loop. */
-            set_var(next_to -> nVar, NULL, q.n);
-            c -> line = next_to -> line;
-            c -> stmt = next_to -> stmt;
+    /* Adjust variable and return to top of loop. */
+    v -> n = q.n;
+    v -> era = vars_era;
+    pc = next_to -> pc;
+    if (ctrl_c)
+        goto pause;
+    go(0);
+
+alter_:
+    do_alter(pc[1].l, pc[2].l);
+    if (warning)
+        goto except;
+    go(3);
+
+onalter_:
+    --np;
+    for (i = 1, dest = pc[2].l; dest; ++i, dest = dest -> next)
+        if (i == *np) {
+            do_alter(pc[1].l, dest);
+            if (warning)
+                goto except;
             break;
+        }
+    go(3);
 
-        case wALTER:
-            do_alter(l -> a[0], l -> a[1]);
-            break;
+#undef go
 
-        case wONALTER:
-            q = evalloc(l -> a[0]);
-            if (q.what == rExcept)
-                return wERROR;
-            for (i = 1, dest = l -> a[2]; dest; ++i, dest = dest -> next)
-                if (i == q.n) {
-                    do_alter(l -> a[1], dest);
-                    break;
-                }
-            break;
+    /* Return to the caller, leaving 'pc' ready to continue. */
+honey_do:
+    c -> pc = pc;
+    return what;
 
-        default:
-            flash('e');
-            printf("unimplemented: %s\n", guys[l -> what]);
-            flash('n');
+pause:
+    c -> pc = pc;
+    return 0;
+
+except:
+    while (sp > ss) {
+        --sp;
+        zap_str(*sp);
     }
+    c -> pc = pc;
+    return wERROR;
+}
 
-    return 0;
+/*
+ *  Where execute() implements each opcode, for the compiler.
+ */
+void **opcode_labels(void)
+{
+    if (!labels)
+        execute(NULL);
+    return labels;
 }
 
 /*
@@ -778,15 +1528,17 @@ like_GOSUB:
  */
 int immediate(lego *l)
 {
-    x_con imm_con;
+    x_con imm_con = { 0 };
+    code *imm_code;
     int running = 0, ran, what;
 
     /*
      *  Case where user types a line into a program, like "10 CLS"
      */
+    fold(l);
     if (l -> what == wNUMBEREDLINE) {
         save_line(l);
-        return 0;       /* We retained or freed 'l' in save_line() */
+        return 0;       /* save_line() kept 'l' in the program, or not */
     }
 
     /*
@@ -796,23 +1548,22 @@ int immediate(lego *l)
         return 1;
 
     /*
-     *  Fully initialize immediate context.
+     *  Compile the immediate command, and initialize its context.
      */
-    imm_con.line = NULL;
-    imm_con.ret_to = NULL;
-    imm_con.next_to = NULL;
-    imm_con.stmt = l;
+    imm_code = compile(l);
+    imm_con.pc = imm_code + 1;
+    imm_con.deep = imm_code[0].i;
     imm_con.lNum = -1;
 
 next_one:
     ran = running;
-    switch (what = single_step(running ? &prog_con : &imm_con)) {
+    switch (what = execute(running ? &prog_con : &imm_con)) {
 
         case wRUN:
         case wGOTO:
         case wONGOTO:
-            /* Link, initialize, and start program. */
-            if (link(program, -1))
+            /* Link, compile, initialize, and start program. */
+            if (!compile_program())
                 break;
 
             /* LET, GOSUB, DATA, FOR left as-is if we used GOTO. */
@@ -821,7 +1572,8 @@ next_one:
                 reset_program();
             }
 
-            prog_con.line = prog_con.stmt = start_at ? start_at : program;
+            prog_con.pc = start_at ? start_at -> link : prog_code + 1;
+            prog_con.deep = prog_code[0].i;
             running = 1;
             break;
 
@@ -835,11 +1587,14 @@ next_one:
             if (!running) {
                 /* Consider immediate statements aborted. */
                 byItself();
+                clear_stacks(&imm_con);
+                zap(imm_code);
                 return 1;
             }
 
             /* Program ended. Keep vars, but clear context. */
             reset_program();
+            drop_trees();
             running = 0;
             break;
 
@@ -850,7 +1605,7 @@ next_one:
 
         case wCONT:
             /* Force program to have context. */
-            if (!prog_con.line)
+            if (!prog_con.pc)
                 warn("can't continue");
             else
                 running = 1;
@@ -866,19 +1621,21 @@ next_one:
     if (warning) {
         advise(warning, ran, prog_con.lNum);
         warning = NULL;
-        if (ran)
+        if (ran) {
             reset_program();
+            drop_trees();
+        }
         else {
-            imm_con.line = imm_con.stmt = NULL;
-            imm_con.ret_to = NULL;
-            imm_con.next_to = NULL;
+            clear_stacks(&imm_con);
+            imm_con.pc = NULL;
         }
     }
 
     /* Handle SIGINT from user and STOP within program. */
     if (ctrl_c) {
+        flush();                /* what was printed before the break */
         if (ctrl_c > 0)
-            printf("\n");
+            outf("\n");
         advise("break", ran, prog_con.lNum);
         running = 0;
         ctrl_c = 0;
@@ -0,0 +1,499 @@
+/*
+    Dayton Dynamic BASIC
+    strings
+    MWA 2018
+*/
+
+#include "all.h"
+
+/*
+ *  Strings are counted. Just before each one's characters is a count of
+ *  references to it, so that sharing a string only bumps the count, and
+ *  it's freed when the last reference is dropped. A string mustn't be
+ *  changed once it's shared.
+ *
+ *  Strings know their length too, so they needn't be scanned and may
+ *  hold CHR$(0). They're still \0 terminated for the C library's sake.
+ */
+typedef struct str_head {
+    int refs;
+    int len;            /* characters in the string */
+    int room;           /* characters it has room for */
+    union {
+        int held;       /* in the space, references from variables */
+        int part;       /* on its own, part of memory it counts toward */
+    };
+} str_head;
+
+/*
+ *  Strings that programs store in variables may go in a string space,
+ *  as on the TRS-80: one block set aside by CLEAR n, which they're carved
+ *  out of one after another. Dropped strings leave holes. When the space is
+ *  full, the collector slides the strings still in use down over the
+ *  holes. Only a string that variables alone refer to can be moved,
+ *  since those are the only references it can find and fix, so any
+ *  other string stays put until it's dropped.
+ *
+ *  Without a string space, or when a string won't fit even after
+ *  collecting, strings are allocated one by one instead.
+ */
+static char *space;         /* the string space, if any */
+static int space_size;      /* bytes in it */
+static int space_used;      /* bytes carved out of it so far */
+static int space_dead;      /* bytes of those in dropped strings */
+static int space_stuck;     /* dropped bytes that collecting couldn't free */
+
+/*
+ *  Strings computed along the way, like those in PRINT RIGHT$(SPACE$(W)
+ *  + STR$(Z), W), are carved out of a scratch area instead. Nothing but
+ *  the statement working on them refers to those, since a variable gets
+ *  a copy of one stored in it, so they're all dropped by the time the
+ *  statement is done. Once the last is dropped, the area starts over.
+ */
+static union {
+    str_head h;             /* for alignment */
+    char c[1 << 16];
+} scratch;
+static int scratch_used;    /* bytes carved out of it so far */
+static int scratch_live;    /* strings in it not yet dropped */
+
+/*
+ *  Bytes a string takes in the string space, keeping headers aligned.
+ */
+static int rec_size(int room)
+{
+    return (sizeof(str_head) + room + 1 + 7) & ~7;
+}
+
+/*
+ *  Tell whether a string is in the string space.
+ */
+static int in_space(char *s)
+{
+    return space && s >= space && s < space + space_size;
+}
+
+/*
+ *  Tell whether a string is in the scratch area.
+ */
+static int in_scratch(char *s)
+{
+    return s >= scratch.c && s < scratch.c + sizeof(scratch);
+}
+
+/*
+ *  Allocate a string of 'len' characters, all \0 for now, on its own,
+ *  counting it toward 'part' of memory.
+ */
+static char *own_str(int len, int part)
+{
+    str_head *h = getmem(sizeof(str_head) + len + 1);
+
+    mem_count(part, sizeof(str_head) + len + 1);
+    h -> refs = 1;
+    h -> len = h -> room = len;
+    h -> part = part;
+    return (char *) (h + 1);
+}
+
+/*
+ *  Allocate a string of 'len' characters, all \0 for now, on its own.
+ *  Strings that outlive a run, like those in legos, are made this way.
+ */
+char *new_str(int len)
+{
+    return own_str(len, mStrings);
+}
+
+/*
+ *  Allocate a string that MEM counts as program rather than strings,
+ *  as a line's tokens are (see tokens.c).
+ */
+char *program_str(int len)
+{
+    return own_str(len, mProgram);
+}
+
+/*
+ *  Allocate a string of 'len' characters for a variable, in the string
+ *  space if there's room.
+ */
+static char *space_str(int len)
+{
+    int size = rec_size(len);
+    str_head *h;
+
+    if (size > space_size - space_used && size <= space_dead
+            && space_dead > space_stuck)
+        collect_strs();
+    if (size > space_size - space_used)
+        return new_str(len);
+
+    h = (str_head *) (space + space_used);
+    space_used += size;
+    memset(h, 0, size);
+    h -> refs = 1;
+    h -> len = h -> room = len;
+    return (char *) (h + 1);
+}
+
+/*
+ *  Allocate a string of 'len' characters for a running program, in the
+ *  scratch area if there's room.
+ */
+char *make_str(int len)
+{
+    int size = rec_size(len);
+    str_head *h;
+
+    if (size > sizeof(scratch) - scratch_used)
+        return space_str(len);
+
+    h = (str_head *) (scratch.c + scratch_used);
+    scratch_used += size;
+    ++scratch_live;
+    mem_count(mStrings, size);
+    memset(h, 0, size);
+    h -> refs = 1;
+    h -> len = h -> room = len;
+    return (char *) (h + 1);
+}
+
+/*
+ *  Move a string out of the scratch area, if it's there, for storing in
+ *  a variable. Uses up the caller's reference to it.
+ */
+static char *hold_str(char *s)
+{
+    char *t;
+
+    if (!s || !in_scratch(s))
+        return s;
+    t = space_str(str_len(s));
+    memcpy(t, s, str_len(s));
+    drop_str(s);
+    return t;
+}
+
+/*
+ *  Store string 's' in a variable's slot '*to', using up the reference
+ *  to it and letting go of the string there before. A scratch string is
+ *  copied over the old one when no one else shares that and it has room
+ *  (but not far too much), so storing computed strings over and over
+ *  allocates nothing. Otherwise the old one is let go of only after 's'
+ *  has a place, since finding one may collect and move it.
+ */
+void store_str(char **to, char *s)
+{
+    str_head *h = *to ? (str_head *) *to - 1 : NULL;
+    int len;
+
+    if (h && s && in_scratch(s) && h -> refs == 1
+            && (in_space(*to) || h -> part == mStrings)) {
+        len = str_len(s);
+        if (len <= h -> room && h -> room <= 2 * len + 32) {
+            memcpy(*to, s, len);
+            (*to)[h -> len = len] = '\0';
+            drop_str(s);
+            return;
+        }
+    }
+    s = hold_str(s);
+    zap_str(*to);
+    *to = s;
+}
+
+/*
+ *  Move a string out of the string space or scratch area, if it's in
+ *  either, using up the caller's reference to it.
+ */
+char *keep_str(char *s)
+{
+    char *t;
+
+    if (!in_space(s) && !in_scratch(s))
+        return s;
+    t = new_str(str_len(s));
+    memcpy(t, s, str_len(s));
+    drop_str(s);
+    return t;
+}
+
+/*
+ *  Tell how long a string is.
+ */
+int str_len(char *s)
+{
+    return ((str_head *) s - 1) -> len;
+}
+
+/*
+ *  Take another reference to a string.
+ */
+char *share_str(char *s)
+{
+    ++((str_head *) s - 1) -> refs;
+    return s;
+}
+
+/*
+ *  Drop a reference to a string, freeing it if that was the last.
+ */
+void drop_str(char *s)
+{
+    str_head *h = (str_head *) s - 1;
+
+    if (--h -> refs)
+        return;
+    if (in_scratch(s)) {
+        if (!--scratch_live) {
+            mem_count(mStrings, -scratch_used);
+            scratch_used = 0;
+        }
+    }
+    else if (in_space(s))
+        space_dead += rec_size(h -> room);
+    else {
+        mem_count(h -> part, -(long) (sizeof(str_head) + h -> room + 1));
+        free(h);
+        ++Frees;
+    }
+}
+
+static void count_held(char **s)
+{
+    if (*s && in_space(*s))
+        ++((str_head *) *s - 1) -> held;
+}
+
+static void forward(char **s)
+{
+    if (*s && in_space(*s))
+        *s = space + ((str_head *) *s - 1) -> held + sizeof(str_head);
+}
+
+/*
+ *  Compact the string space. First count how many references to each
+ *  string are from variables, then work out where each string goes
+ *  (leaving those with other references where they are), then point
+ *  variables there, and finally move the strings.
+ */
+void collect_strs(void)
+{
+    str_head *h, *hole;
+    int at, to, size, live = 0;
+
+    for (at = 0; at < space_used; at += size) {
+        h = (str_head *) (space + at);
+        size = rec_size(h -> room);
+        h -> held = 0;
+    }
+    each_var_str(count_held);
+
+    for (at = to = 0; at < space_used; at += size) {
+        h = (str_head *) (space + at);
+        size = rec_size(h -> room);
+        if (!h -> refs)
+            continue;
+        if (h -> held != h -> refs)
+            to = at;                /* pinned */
+        h -> held = to;
+        to += size;
+    }
+    each_var_str(forward);
+
+    for (at = to = 0; at < space_used; at += size) {
+        h = (str_head *) (space + at);
+        size = rec_size(h -> room);
+        if (!h -> refs)
+            continue;
+        if (h -> held > to) {
+            /* Fill the hole before a pinned string with a dropped one. */
+            hole = (str_head *) (space + to);
+            memset(hole, 0, sizeof(str_head));
+            hole -> room = h -> held - to - sizeof(str_head) - 1;
+        }
+        to = h -> held;
+        memmove(space + to, h, size);
+        to += size;
+        live += size;
+    }
+    space_used = to;
+    space_dead = space_stuck = to - live;
+}
+
+/*
+ *  Set aside a string space of 'bytes', or none if 0, as CLEAR n does.
+ *  Variables must have let go of their strings first. Returns 0 (with a
+ *  warning) if strings in the old space are still in use.
+ */
+int str_space(int bytes)
+{
+    if (space) {
+        collect_strs();
+        if (space_used) {
+            warn("strings still in use");
+            return 0;
+        }
+        zap(space);
+        mem_count(mStrings, -space_size);
+    }
+    space_size = space_used = space_dead = space_stuck = 0;
+    if (bytes) {
+        space = getmem(bytes);
+        space_size = bytes;
+        mem_count(mStrings, bytes);
+    }
+    return 1;
+}
+
+/*
+ *  Tell whether there's a string space.
+ */
+int str_spaced(void)
+{
+    return !!space;
+}
+
+/*
+ *  Tell how much of the string space is free, as FRE("") does, counting
+ *  what collecting would get back.
+ */
+int str_free(void)
+{
+    return space_size - space_used + space_dead;
+}
+
+/*
+ *  Strings of one character, and the empty string, are made just once
+ *  and shared from then on, so that taking text apart a character at a
+ *  time allocates nothing. The table holds a reference to each, so none
+ *  is ever freed or changed.
+ */
+static struct {
+    str_head h;
+    char c[2];
+} shorts[257];
+
+/*
+ *  Return the string of character 'c', or the empty string if 'c' < 0.
+ */
+char *char_str(int c)
+{
+    int i = c < 0 ? 256 : c;
+
+    if (!shorts[i].h.refs) {
+        shorts[i].h.refs = 1;
+        shorts[i].h.len = shorts[i].h.room = c >= 0;
+        shorts[i].c[0] = c;
+    }
+    return share_str(shorts[i].c);
+}
+
+/*
+ *  Strings of one character repeated, as SPACE$ and STRING$ give, are
+ *  kept in a small cache when they're short, since programs tend to
+ *  ask for the same few over and over.
+ */
+enum { run_slots = 64, max_run = 255 };
+
+static char *runs[run_slots];
+
+/*
+ *  Return a string of 'n' copies of character 'c'.
+ */
+char *run_str(int c, int n)
+{
+    char **e, *s;
+
+    if (n <= 1)
+        return char_str(n ? c : -1);
+    if (n > max_run) {
+        s = make_str(n);
+        memset(s, c, n);
+        return s;
+    }
+    e = &runs[(c * 31 + n) % run_slots];
+    if (!*e || str_len(*e) != n || (unsigned char) **e != c) {
+        zap_str(*e);
+        *e = new_str(n);
+        memset(*e, c, n);
+    }
+    return share_str(*e);
+}
+
+/*
+ *  Empty the cache of repeated characters.
+ */
+void free_runs(void)
+{
+    int i;
+
+    for (i=0; i<run_slots; i++)
+        zap_str(runs[i]);
+}
+
+/*
+ *  Return characters 'from' up to 'upto' of a string, as LEFT$, MID$
+ *  and RIGHT$ do. The whole string is shared, and strings of one
+ *  character or none come from the table above, so those aren't copied.
+ *
+ *  Other substrings are copied, not made views into 's'. A string is a
+ *  pointer to characters that follow its own header and end in \0, so
+ *  a view in the middle of 's' has nowhere to keep its length and count,
+ *  and every string user would have to learn about a second kind. So a
+ *  substring costs copying its characters, into the scratch area, and
+ *  again when it's stored: over the variable's old string if that has
+ *  room (see store_str()), or else into a new one, which without a
+ *  string space means a malloc(). Chopping a string down a character at
+ *  a time, as in T$ = RIGHT$(T$, LEN(T$) - 1), thus takes time that
+ *  grows with the square of its length.
+ */
+char *substr(char *s, int from, int upto)
+{
+    char *t;
+
+    if (upto - from <= 1)
+        return char_str(upto > from ? (unsigned char) s[from] : -1);
+    if (!from && upto == str_len(s))
+        return share_str(s);
+    t = make_str(upto - from);
+    memcpy(t, s + from, upto - from);
+    return t;
+}
+
+/*
+ *  Append 'n' characters to a string, using up the caller's reference
+ *  to it, and return the result. A string no one else shares grows in
+ *  place, with room to spare so that appending over and over takes
+ *  linear time. A shared one is copied instead, as is one that must
+ *  grow out of its place in the string space.
+ */
+char *append_str(char *s, char *t, int n)
+{
+    str_head *h = (str_head *) s - 1;
+    int len = h -> len, room = len + n;
+
+    if (h -> refs > 1 || room > h -> room) {
+        if (room < 1 << 29)
+            room *= 2;
+        if (h -> refs > 1 || in_space(s) || in_scratch(s)) {
+            s = space_str(room);
+            memcpy(s, (char *) (h + 1), len);
+            drop_str((char *) (h + 1));
+            h = (str_head *) s - 1;
+        }
+        else {
+            mem_count(h -> part, room - h -> room);
+            if (!(h = realloc(h, sizeof(str_head) + room + 1))) {
+                outf("out of memory\n");
+                exit(1);
+            }
+        }
+        h -> room = room;
+    }
+    s = (char *) (h + 1);
+    memcpy(s + len, t, n);
+    s[h -> len = len + n] = '\0';
+    return s;
+}
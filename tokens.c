@@ -0,0 +1,197 @@
+/*
+    Dayton Dynamic BASIC
+    tokenized lines
+    MWA 2018
+*/
+
+#include "all.h"
+
+/*
+ *  With COMPACT set, program lines are kept as tokens, much as classic
+ *  BASICs kept them, rather than as trees of legos. Each lego becomes
+ *  its 'what' as a single byte, a byte of flags, and a byte saying
+ *  which arguments follow, then whatever it has of these, in order:
+ *
+ *      lit_delim       one byte
+ *      n               a whole number as a varint, or else 8 bytes
+ *      s               its length as a varint, then its characters
+ *
+ *  Its arguments come next, then whatever follows it in its list.
+ *  Links aren't kept; they're made again when a line is unpacked.
+ */
+enum {
+    tParens = 1, tListDelim = 2, tAbbrev = 4, tLitDelim = 8,
+    tWhole = 16, tNum = 32, tString = 64, tNext = 128
+};
+
+static unsigned char *buf;  /* tokens being written */
+static int used;            /* bytes in 'buf' */
+static int bytes;           /* bytes allocated for 'buf' */
+
+/*
+ *  Add 'n' bytes to the tokens being written.
+ */
+static void put(void *p, int n)
+{
+    if (used + n > bytes) {
+        while (used + n > bytes)
+            bytes = bytes ? 2 * bytes : 256;
+        if (!buf)
+            buf = getmem(bytes);
+        else if (!(buf = realloc(buf, bytes))) {
+            outf("out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(buf + used, p, n);
+    used += n;
+}
+
+/*
+ *  Add a whole number, seven bits at a time, low bits first.
+ */
+static void put_varint(unsigned long long u)
+{
+    unsigned char c;
+
+    do {
+        c = u & 127;
+        if (u >>= 7)
+            c |= 128;
+        put(&c, 1);
+    } while (u);
+}
+
+/*
+ *  Add the tokens for a list of legos.
+ */
+static void put_legos(lego *l)
+{
+    unsigned char head[3];
+    long long whole;
+    int i;
+
+    for (; l; l = l -> next) {
+        whole = fabs(l -> n) < 1e15 ? l -> n : 0;
+        head[0] = l -> what;
+        head[1] = (l -> force_parens ? tParens : 0)
+            | (l -> list_delim ? tListDelim : 0)
+            | (l -> abbrev ? tAbbrev : 0)
+            | (l -> lit_delim ? tLitDelim : 0)
+            | (!l -> n ? 0 : whole == l -> n ? tWhole : tNum)
+            | (l -> s ? tString : 0)
+            | (l -> next ? tNext : 0);
+        head[2] = 0;
+        for (i=0; i<l -> args; i++)
+            if (l -> a[i])
+                head[2] |= 1 << i;
+        put(head, 3);
+
+        if (l -> lit_delim)
+            put(&l -> lit_delim, 1);
+        if (head[1] & tWhole)       /* zigzag, so small negatives are short */
+            put_varint(whole < 0 ? ~((unsigned long long) whole << 1)
+                : (unsigned long long) whole << 1);
+        else if (head[1] & tNum)
+            put(&l -> n, sizeof(double));
+        if (l -> s) {
+            put_varint(str_len(l -> s));
+            put(l -> s, str_len(l -> s));
+        }
+        for (i=0; i<l -> args; i++)
+            put_legos(l -> a[i]);
+    }
+}
+
+/*
+ *  Return a counted string holding the tokens for a list of legos.
+ *  MEM counts it as program.
+ */
+char *tokenize(lego *l)
+{
+    char *t;
+
+    used = 0;
+    put_legos(l);
+    t = program_str(used);
+    memcpy(t, buf, used);
+    return t;
+}
+
+/*
+ *  Free the buffer that tokens are written in.
+ */
+void free_tokens(void)
+{
+    zap(buf);
+    used = bytes = 0;
+}
+
+/*
+ *  Take a whole number from the tokens at '*p'.
+ */
+static unsigned long long get_varint(unsigned char **p)
+{
+    unsigned long long u = 0;
+    int shift = 0;
+
+    do
+        u |= (unsigned long long) (**p & 127) << shift, shift += 7;
+    while (*(*p)++ & 128);
+    return u;
+}
+
+/*
+ *  Rebuild a list of legos from the tokens at '*p', advancing '*p'.
+ */
+static lego *get_legos(unsigned char **p)
+{
+    lego *res = NULL, **tail = &res, *l;
+    unsigned char *t = *p, flags, args;
+    unsigned long long u;
+    int i, len;
+
+    do {
+        l = *tail = newLego(t[0]);
+        tail = &l -> next;
+        flags = t[1];
+        args = t[2];
+        t += 3;
+
+        l -> force_parens = !!(flags & tParens);
+        l -> list_delim = !!(flags & tListDelim);
+        l -> abbrev = !!(flags & tAbbrev);
+        if (flags & tLitDelim)
+            l -> lit_delim = *t++;
+        if (flags & tWhole) {
+            u = get_varint(&t);
+            l -> n = (long long) (u & 1 ? ~(u >> 1) : u >> 1);
+        }
+        else if (flags & tNum) {
+            memcpy(&l -> n, t, sizeof(double));
+            t += sizeof(double);
+        }
+        if (flags & tString) {
+            len = get_varint(&t);
+            l -> s = memcpy(new_str(len), t, len);
+            t += len;
+        }
+        for (i=0; i<l -> args; i++)
+            if (args & 1 << i)
+                l -> a[i] = get_legos(&t);
+    } while (flags & tNext);
+
+    *p = t;
+    return res;
+}
+
+/*
+ *  Rebuild a list of legos from tokens that tokenize() wrote, in the
+ *  current arena.
+ */
+lego *untokenize(char *t)
+{
+    unsigned char *p = (unsigned char *) t;
+
+    return str_len(t) ? get_legos(&p) : NULL;
+}
@@ -5,9 +5,12 @@
 */
 
 #include "all.h"
+#include <errno.h>
+#include <unistd.h>     /* not in all.h, whose link() it would clash with */
 
 int Mallocs, Frees;     /* diagnostic memory counts */
-lego *legos;            /* free legos */
+long mem_now[mTotal + 1];   /* bytes in use by each part, and in all */
+long mem_peak[mTotal + 1];  /* the most each has used at once */
 char *warning;          /* first encountered with most recent line typed */
 int noANSI;             /* do not output escape sequences */
 int ctrl_c;             /* provision to stop running program */
@@ -15,6 +18,401 @@ FILE *urandom;          /* CSPRNG source */
 
 static char *prompt = "Ok\n";
 
+/*
+ *  Output is gathered here and written in big pieces, rather than a
+ *  few characters at a time. It's flushed before any input is read,
+ *  after an error or break, when full, and at exit - and at the end
+ *  of each line when someone is watching a terminal.
+ */
+static char outbuf[1 << 16];
+static int outlen;      /* bytes waiting in 'outbuf' */
+static int tty;         /* standard output is a terminal */
+int writes;             /* write() calls made for output; see WRITES */
+
+/*
+ *  Write 'n' characters to standard output directly, counting each
+ *  write() it takes.
+ */
+static void write_out(char *s, int n)
+{
+    int done;
+
+    while (n > 0) {
+        done = write(STDOUT_FILENO, s, n);
+        if (done < 0 && errno == EINTR)
+            continue;           /* CTRL-C */
+        if (done <= 0)
+            return;
+        ++writes;
+        s += done, n -= done;
+    }
+}
+
+/*
+ *  Write out whatever output is waiting.
+ */
+void flush(void)
+{
+    write_out(outbuf, outlen);
+    outlen = 0;
+}
+
+/*
+ *  Output 'n' characters.
+ */
+void out_mem(char *s, int n)
+{
+    if (outlen + n > sizeof(outbuf)) {
+        flush();
+        if (n > sizeof(outbuf)) {
+            write_out(s, n);
+            return;
+        }
+    }
+    memcpy(outbuf + outlen, s, n);
+    outlen += n;
+    if (tty && memchr(s, '\n', n))
+        flush();
+}
+
+/*
+ *  Output a \0 terminated string.
+ */
+void out_str(char *s)
+{
+    out_mem(s, strlen(s));
+}
+
+/*
+ *  Output as printf() would.
+ */
+void outf(char *fmt, ...)
+{
+    va_list ap;
+    char *big;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(outbuf + outlen, sizeof(outbuf) - outlen, fmt, ap);
+    va_end(ap);
+    if (outlen + n < sizeof(outbuf)) {
+        outlen += n;
+        if (tty && memchr(outbuf + outlen - n, '\n', n))
+            flush();
+        return;
+    }
+
+    /* It didn't fit, so make room and do it over. */
+    flush();
+    va_start(ap, fmt);
+    if (n < sizeof(outbuf)) {
+        outlen = vsnprintf(outbuf, sizeof(outbuf), fmt, ap);
+        if (tty && memchr(outbuf, '\n', n))
+            flush();
+    }
+    else {
+        big = getmem(n + 1);
+        vsnprintf(big, n + 1, fmt, ap);
+        write_out(big, n);
+        zap(big);
+    }
+    va_end(ap);
+}
+
+/*
+ *  Write the digits of a whole number below 2^53 ending just before 'end',
+ *  returning where they start.
+ */
+static char *digits(double n, char *end)
+{
+    unsigned long long u = n;
+
+    do
+        *--end = '0' + u % 10;
+    while (u /= 10);
+    return end;
+}
+
+/*
+ *  Shortest digits for any double, by Loitsch's Grisu2: scale the
+ *  number and the ends of the range of reals that read back as it by a
+ *  cached power of ten, then generate digits until what's left is
+ *  within that range. A diy_fp is f * 2^e with f held to 64 bits.
+ */
+typedef struct { uint64_t f; int e; } diy_fp;
+
+static diy_fp powers[87] = {     /* 10^-348, 10^-340, ... 10^340 */
+    { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 },
+    { 0x8b16fb203055ac76ULL, -1166 }, { 0xcf42894a5dce35eaULL, -1140 },
+    { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 },
+    { 0xbe5691ef416bd60cULL, -1007 }, { 0x8dd01fad907ffc3cULL, -980 },
+    { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+    { 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 },
+    { 0x823c12795db6ce57ULL, -847 }, { 0xc21094364dfb5637ULL, -821 },
+    { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+    { 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 },
+    { 0xb23867fb2a35b28eULL, -688 }, { 0x84c8d4dfd2c63f3bULL, -661 },
+    { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+    { 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 },
+    { 0xf3e2f893dec3f126ULL, -529 }, { 0xb5b5ada8aaff80b8ULL, -502 },
+    { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+    { 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 },
+    { 0xa6dfbd9fb8e5b88fULL, -369 }, { 0xf8a95fcf88747d94ULL, -343 },
+    { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+    { 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 },
+    { 0xe45c10c42a2b3b06ULL, -210 }, { 0xaa242499697392d3ULL, -183 },
+    { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+    { 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 },
+    { 0x9c40000000000000ULL, -50 }, { 0xe8d4a51000000000ULL, -24 },
+    { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+    { 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 },
+    { 0xd5d238a4abe98068ULL, 109 }, { 0x9f4f2726179a2245ULL, 136 },
+    { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+    { 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 },
+    { 0x924d692ca61be758ULL, 269 }, { 0xda01ee641a708deaULL, 295 },
+    { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+    { 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 },
+    { 0xc83553c5c8965d3dULL, 428 }, { 0x952ab45cfa97a0b3ULL, 455 },
+    { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+    { 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 },
+    { 0x88fcf317f22241e2ULL, 588 }, { 0xcc20ce9bd35c78a5ULL, 614 },
+    { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+    { 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 },
+    { 0xbb764c4ca7a44410ULL, 747 }, { 0x8bab8eefb6409c1aULL, 774 },
+    { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+    { 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 },
+    { 0x80444b5e7aa7cf85ULL, 907 }, { 0xbf21e44003acdd2dULL, 933 },
+    { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+    { 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 },
+    { 0xaf87023b9bf0ee6bULL, 1066 }
+};
+
+static diy_fp diy_mul(diy_fp x, diy_fp y)
+{
+    uint64_t a = x.f >> 32, b = x.f & 0xffffffff;
+    uint64_t c = y.f >> 32, d = y.f & 0xffffffff;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+
+    mid += 1U << 31;            /* round the lower half */
+    return (diy_fp) { ac + (ad >> 32) + (bc >> 32) + (mid >> 32),
+        x.e + y.e + 64 };
+}
+
+static diy_fp diy_normal(diy_fp x)
+{
+    while (!(x.f >> 63))
+        x.f <<= 1, --x.e;
+    return x;
+}
+
+/*
+ *  Back the last digit off toward the number itself while that stays
+ *  within range, so the digits are the closest of the shortest.
+ */
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+    uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+            (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+        --buf[len - 1], rest += ten_kappa;
+}
+
+/*
+ *  Put the digits of finite 'n' > 0 into 'buf', returning how many, and
+ *  set '*k' so that 'n' reads back from them times 10^*k. The scaled
+ *  range is off by up to a unit at each end, so it's narrowed by that to
+ *  be safe, which now and then costs a digit; if 'wide', it's widened
+ *  instead, and the digits might not read back.
+ */
+static int grisu2(double n, char *buf, int *k, int wide)
+{
+    static uint64_t tens[20] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+        1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19 };
+    uint64_t bits, p2, delta, wp_w, ten_kappa;
+    uint32_t p1;
+    diy_fp v, plus, minus, c, w, one;
+    int i, kappa, len = 0;
+    unsigned d;
+
+    memcpy(&bits, &n, sizeof bits);
+    v.f = bits & 0xfffffffffffff;
+    v.e = bits >> 52;
+    if (v.e)
+        v.f += 1ULL << 52, v.e -= 1075;
+    else
+        v.e = -1074;            /* subnormal */
+
+    /* The range that reads back as 'n' is between 'minus' and 'plus'. */
+    plus = diy_normal((diy_fp) { (v.f << 1) + 1, v.e - 1 });
+    minus = v.f == 1ULL << 52 ? (diy_fp) { (v.f << 2) - 1, v.e - 2 }
+        : (diy_fp) { (v.f << 1) - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    /* Scale so the binary exponent is around -60. */
+    i = ceil((-61 - plus.e) * 0.30102999566398114) + 347;
+    i = (i >> 3) + 1;
+    *k = 348 - i * 8;
+    c = powers[i];
+    w = diy_mul(diy_normal(v), c);
+    plus = diy_mul(plus, c);
+    minus = diy_mul(minus, c);
+    if (wide)
+        --minus.f, ++plus.f;
+    else
+        ++minus.f, --plus.f;    /* stay within for sure */
+
+    /* Whole part digits, then fraction digits, till within range. */
+    one = (diy_fp) { 1ULL << -plus.e, plus.e };
+    wp_w = plus.f - w.f;
+    delta = plus.f - minus.f;
+    p1 = plus.f >> -one.e;
+    p2 = plus.f & (one.f - 1);
+    for (kappa=10; kappa>1 && p1<tens[kappa-1]; kappa--)
+        ;
+    while (kappa > 0) {
+        d = p1 / tens[kappa - 1];
+        p1 %= tens[kappa - 1];
+        if (d || len)
+            buf[len++] = '0' + d;
+        --kappa;
+        if (((uint64_t) p1 << -one.e) + p2 <= delta) {
+            *k += kappa;
+            ten_kappa = tens[kappa] << -one.e;
+            grisu_round(buf, len, delta, ((uint64_t) p1 << -one.e) + p2,
+                ten_kappa, wp_w);
+            return len;
+        }
+    }
+    for (;;) {
+        p2 *= 10, delta *= 10;
+        d = p2 >> -one.e;
+        if (d || len)
+            buf[len++] = '0' + d;
+        p2 &= one.f - 1;
+        --kappa;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, p2, one.f,
+                -kappa < 20 ? wp_w * tens[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+/*
+ *  Write a number as text into 'buf', which holds 'num_room' bytes, and
+ *  return it. Whole numbers are written as such, and others as the
+ *  fewest digits that read back as the same number. This is how PRINT,
+ *  STR$ and LIST show numbers.
+ */
+char *num_text(double n, char *buf)
+{
+    static double tens[16] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+    char *s, *end = buf + num_room - 1, dig[20];
+    double a = fabs(n), m;
+    int d, len, k, x;
+
+    *end = '\0';
+    if (a < 9007199254740992.0 && trunc(a) == a) {
+        s = digits(a, end);
+        if (signbit(n))
+            *--s = '-';
+        return memmove(buf, s, end - s + 1);
+    }
+    if (a < 1e21 && trunc(a) == a) {
+        snprintf(buf, num_room, "%.0f", n);     /* too big to do above */
+        return buf;
+    }
+
+    /*
+     *  Try fixed point with 1, 2, ... decimals, as long as all of the
+     *  digits fit in a double exactly. Dividing exactly by an exact power
+     *  of ten rounds the same way reading the text back does.
+     */
+    if (isfinite(a) && a < 1e15)
+        for (d=1; d<=15; d++) {
+            m = round(a * tens[d]);
+            if (m >= tens[15])
+                break;
+            if (m / tens[d] != a)
+                continue;
+            s = digits(m, end);
+            while (end - s <= d)
+                *--s = '0';             /* so there's a 0 before the point */
+            memmove(s - 1, s, end - s - d);
+            end[-d - 1] = '.';
+            --s;
+            if (signbit(n))
+                *--s = '-';
+            return memmove(buf, s, end - s + 1);
+        }
+
+    if (!isfinite(a)) {
+        snprintf(buf, num_room, "%g", n);
+        return buf;
+    }
+
+    /*
+     *  Otherwise, the shortest digits, laid out as %.15g would (or %.16g
+     *  or %.17g, for that many): in E form for exponents below -4 or past
+     *  the digits shown.
+     */
+    s = buf;
+    if (signbit(n))
+        *s++ = '-';
+    len = grisu2(a, dig, &k, 0);
+    if (len > 15 && (d = grisu2(a, s, &x, 1)) < len) {
+        sprintf(s + d, "e%d", x);       /* fewer if they do read back */
+        if (strtod(s, NULL) == a) {
+            memcpy(dig, s, d);
+            len = d, k = x;
+        }
+    }
+    x = len + k - 1;            /* exponent of the first digit */
+    if (x < -4 || x >= (len < 15 ? 15 : len)) {
+        *s++ = dig[0];
+        if (len > 1) {
+            *s++ = '.';
+            memcpy(s, dig + 1, len - 1);
+            s += len - 1;
+        }
+        s += sprintf(s, "e%c%02d", x < 0 ? '-' : '+', abs(x));
+    }
+    else if (x < 0) {
+        s += sprintf(s, "0.%.*s", -x - 1, "0000");
+        memcpy(s, dig, len);
+        s += len;
+        *s = '\0';
+    }
+    else {
+        memcpy(s, dig, x + 1 < len ? x + 1 : len);
+        for (d=len; d<=x; d++)
+            s[d] = '0';         /* whole, past the digits */
+        s += x + 1;
+        if (len > x + 1) {
+            *s++ = '.';
+            memcpy(s, dig + x + 1, len - x - 1);
+            s += len - x - 1;
+        }
+        *s = '\0';
+    }
+    return buf;
+}
+
+/*
+ *  Output a number the way PRINT does.
+ */
+void out_num(double n)
+{
+    char buf[num_room];
+
+    out_str(num_text(n, buf));
+}
+
 /*
  *  Get zeroed memory or perish.
  */
@@ -23,7 +421,7 @@ void *getmem(int bytes)
     void *m = calloc(bytes, 1);
 
     if (!m) {
-        puts("out of memory");
+        outf("out of memory\n");
         exit(1);
     }
 
@@ -31,6 +429,34 @@ void *getmem(int bytes)
     return m;
 }
 
+/*
+ *  Note that a part of DDB has taken 'bytes' more memory, or given some
+ *  back if negative.
+ */
+void mem_count(int part, long bytes)
+{
+    if ((mem_now[part] += bytes) > mem_peak[part])
+        mem_peak[part] = mem_now[part];
+    if ((mem_now[mTotal] += bytes) > mem_peak[mTotal])
+        mem_peak[mTotal] = mem_now[mTotal];
+}
+
+/*
+ *  Show where memory goes, as MEM does: legos of the program and of the
+ *  lines being run, variable slots, string data (the string space as a
+ *  whole, if there is one), GOSUB and FOR stacks, and spare lego blocks.
+ */
+void mem_report(void)
+{
+    static char *parts[] = { "program", "variables", "strings", "stacks",
+        "spare", "total" };
+    int i;
+
+    outf("%-10s %12s %12s\n", "", "bytes now", "most");
+    for (i=0; i<=mTotal; i++)
+        outf("%-10s %12ld %12ld\n", parts[i], mem_now[i], mem_peak[i]);
+}
+
 /*
  *  Allocate and copy a (sub)string.
  *  If 'upto' is NULL, the whole string (to \0) will be copied.
@@ -38,7 +464,7 @@ void *getmem(int bytes)
 char *copySubstring(char *from, char *upto)
 {
     int len = upto ? upto - from : strlen(from);
-    char *res = getmem(1 + len);
+    char *res = new_str(len);
 
     memcpy(res, from, len);
     res[len] = '\0';
@@ -46,44 +472,333 @@ char *copySubstring(char *from, char *upto)
 }
 
 /*
- *  Get a lego from the free pile or the "box."
+ *  Legos are carved in turn from blocks belonging to an arena, and go
+ *  all at once when their arena does, rather than a lego at a time.
+ *  Each line typed is parsed into an arena of its own, and a program
+ *  loaded from a file into one arena for all of its lines. An arena
+ *  is freed when the last program line in it is deleted or replaced;
+ *  one holding an immediate command goes once the command is done.
  *
- *  This approach probably adds more complexity than value for this use.
- *  Straight malloc and free would be okay, especially considering all
- *  the string processing and other places we go that route, and also
- *  considering that most malloc and free use would be for long-running
- *  BASIC code, not the up-front parsing of the program.
+ *  Blocks are aligned on their size, so a lego finds its block, and
+ *  thus its arena, by rounding its address down. A block holds just
+ *  its owner besides legos, which are of different sizes (see 'args'
+ *  in all.h) and follow one another; a lego of kind 0 ends a block
+ *  that the next lego didn't fit in. The rest of the bookkeeping is
+ *  in the arena. Blocks are cut from bigger slabs, and those freed
+ *  are kept for reuse, much as legos were. A slab whose blocks are all
+ *  spare again is freed, but for one kept on hand.
+ */
+enum { block_size = 512, slab_size = 1 << 16 };
+
+struct arena {
+    struct block **blocks;  /* in the order they were added */
+    int count, room;        /* blocks, and room in 'blocks' */
+    int used;               /* bytes handed out from the last block */
+    int holds;              /* program lines in it, and others keeping it */
+};
+
+typedef struct block {
+    union {
+        arena *owner;
+        struct block *spare;    /* next spare block, when it's spare */
+    };
+    struct slab *home;      /* the slab it was cut from */
+    lego legos[];           /* really bytes; see lego_at() */
+} block;
+
+enum { block_room = block_size - sizeof(block) };
+
+/*
+ *  Bytes a lego with room for 'args' children takes.
+ */
+static int lego_size(int args)
+{
+    return offsetof(lego, a) + args * sizeof(lego *);
+}
+
+/*
+ *  The lego 'at' bytes into a block.
+ */
+static lego *lego_at(block *b, int at)
+{
+    return (lego *) ((char *) b -> legos + at);
+}
+
+arena *lego_arena;      /* where newLego() gets legos */
+
+/*
+ *  A slab's first block keeps track of the rest.
+ */
+typedef struct slab {
+    struct slab *next, *prev;   /* in 'roomy' */
+    block *spares;              /* its blocks in no arena */
+    int used;                   /* its blocks in arenas */
+} slab;
+
+static slab *roomy;     /* slabs with both spare blocks and used ones */
+static slab *idle;      /* a slab with every block spare, if any */
+
+static void add_roomy(slab *s)
+{
+    s -> prev = NULL;
+    if (s -> next = roomy)
+        roomy -> prev = s;
+    roomy = s;
+}
+
+static void remove_roomy(slab *s)
+{
+    if (s -> prev)
+        s -> prev -> next = s -> next;
+    else
+        roomy = s -> next;
+    if (s -> next)
+        s -> next -> prev = s -> prev;
+}
+
+/*
+ *  Get a spare block, cutting up a new slab if there are none.
+ */
+static block *get_block(void)
+{
+    slab *s = roomy;
+    char *p;
+    block *b;
+
+    if (!s && (s = idle))
+        idle = NULL, add_roomy(s);
+    if (!s) {
+        if (!(s = aligned_alloc(block_size, slab_size))) {
+            outf("out of memory\n");
+            exit(1);
+        }
+        ++Mallocs;
+        mem_count(mSpare, slab_size - block_size);
+        s -> spares = NULL;
+        s -> used = 0;
+        for (p = (char *) s + slab_size - block_size; p > (char *) s;
+                p -= block_size) {
+            ((block *) p) -> spare = s -> spares;
+            ((block *) p) -> home = s;
+            s -> spares = (block *) p;
+        }
+        add_roomy(s);
+    }
+    b = s -> spares;
+    if (!(s -> spares = b -> spare))
+        remove_roomy(s);        /* full */
+    ++s -> used;
+    mem_count(mSpare, -block_size);
+    mem_count(mProgram, block_size);
+    return b;
+}
+
+/*
+ *  Free a slab whose blocks are all spare.
+ */
+static void free_slab(slab *s)
+{
+    free(s);
+    ++Frees;
+    mem_count(mSpare, block_size - slab_size);
+}
+
+/*
+ *  Make a block spare again, freeing its slab if that was the last one
+ *  in use there and another slab is on hand already.
+ */
+static void put_block(block *b)
+{
+    slab *s = b -> home;
+
+    if (!s -> spares)
+        add_roomy(s);           /* not full now */
+    b -> spare = s -> spares;
+    s -> spares = b;
+    if (--s -> used)
+        return;
+    remove_roomy(s);
+    if (idle)
+        free_slab(s);
+    else
+        idle = s;
+}
+
+/*
+ *  Free the slab on hand, once no arenas are left.
+ */
+void free_blocks(void)
+{
+    if (idle)
+        free_slab(idle);
+    idle = NULL;
+}
+
+/*
+ *  Start an empty arena.
+ */
+arena *new_arena(void)
+{
+    return getmem(sizeof(arena));
+}
+
+/*
+ *  Free an arena's blocks, and the strings of the legos in them.
+ */
+static void free_arena(arena *a)
+{
+    int i, at, used;
+    lego *l;
+
+    mem_count(mProgram, -(long) a -> count * block_size);
+    mem_count(mSpare, (long) a -> count * block_size);
+    for (i=0; i<a -> count; i++) {
+        used = i + 1 < a -> count ? block_room : a -> used;
+        for (at = 0; at + lego_size(0) <= used; at += lego_size(l -> args)) {
+            l = lego_at(a -> blocks[i], at);
+            if (!l -> what)
+                break;              /* the rest went unused */
+            zap_str(l -> s);
+        }
+        put_block(a -> blocks[i]);
+    }
+    zap(a -> blocks);
+    zap(a);
+}
+
+/*
+ *  Be done with an arena, freeing it unless program lines are in it.
+ */
+void end_arena(arena *a)
+{
+    if (a && !a -> holds)
+        free_arena(a);
+}
+
+/*
+ *  Keep an arena until it's let go of as many times.
+ */
+void keep_arena(arena *a)
+{
+    ++a -> holds;
+}
+
+/*
+ *  Let go of an arena, freeing it if no one else keeps it.
+ */
+void drop_arena(arena *a)
+{
+    if (!--a -> holds)
+        free_arena(a);
+}
+
+/*
+ *  The arena a lego came from.
+ */
+static arena *owner(lego *l)
+{
+    return ((block *) ((uintptr_t) l & ~(uintptr_t) (block_size - 1)))
+        -> owner;
+}
+
+/*
+ *  Note that a line is now in the program, keeping its arena.
+ */
+void keep_line(lego *line)
+{
+    keep_arena(owner(line));
+}
+
+/*
+ *  Note that a line has left the program, perhaps freeing its arena.
+ */
+void drop_line(lego *line)
+{
+    drop_arena(owner(line));
+}
+
+/*
+ *  Get a lego from the current arena, adding a block if it's full.
  */
 lego *newLego(int what)
 {
+    arena *a = lego_arena;
+    int args = lego_args(what), size = lego_size(args);
+    block *b;
     lego *l;
 
-    if (legos)
-        l = legos, legos = l -> next;
-    else
-        l = getmem(sizeof(lego));
+    if (!a -> count || a -> used + size > block_room) {
+        if (a -> count && a -> used + lego_size(0) <= block_room)
+            lego_at(a -> blocks[a -> count - 1], a -> used) -> what = 0;
+        if (a -> count == a -> room) {
+            a -> room = a -> room ? 2 * a -> room : 4;
+            if (!a -> blocks)
+                a -> blocks = getmem(a -> room * sizeof(block *));
+            else if (!(a -> blocks = realloc(a -> blocks,
+                    a -> room * sizeof(block *)))) {
+                outf("out of memory\n");
+                exit(1);
+            }
+        }
+        b = get_block();
+        b -> owner = a;
+        a -> blocks[a -> count++] = b;
+        a -> used = 0;
+    }
+    l = lego_at(a -> blocks[a -> count - 1], a -> used);
+    a -> used += size;
 
-    memset(l, 0, sizeof(lego));
+    memset(l, 0, size);
     l -> what = what;
+    l -> args = args;
     return l;
 }
 
 /*
- *  Return a lego to the free pile.
+ *  Make a lego of kind 'what' out of 'l'. A kind that has more under it
+ *  needs more room, so 'l' grows in place if it's the last lego handed
+ *  out, or else is copied to a new one. Use the lego returned.
+ */
+lego *reLego(lego *l, int what)
+{
+    arena *a = lego_arena;
+    int args = lego_args(what);
+    int more = lego_size(args) - lego_size(l -> args);
+    lego *k;
+
+    if (more > 0) {
+        if (a -> count && a -> used + more <= block_room
+                && (char *) l + lego_size(l -> args)
+                    == (char *) lego_at(a -> blocks[a -> count - 1], a -> used)) {
+            a -> used += more;
+            memset(&l -> a[l -> args], 0, more);
+        }
+        else {
+            k = newLego(what);
+            memcpy(k, l, lego_size(l -> args));
+            l -> s = NULL;          /* 'k' has it now */
+            l = k;
+        }
+        l -> args = args;
+    }
+    l -> what = what;
+    return l;
+}
+
+/*
+ *  Let go of a tree of legos that won't be used. The legos themselves
+ *  stay in their arena until it goes, but their strings go now.
  */
 void byeLego(lego *tree)
 {
-    lego *next;
     int i;
 
-    for (; tree; tree = next) {
-        for (i=0; i<max_args; i++)
+    for (; tree; tree = tree -> next) {
+        for (i=0; i<tree -> args; i++)
             byeLego(tree -> a[i]);
-        if (tree -> s)
-            zap(tree -> s);
-        next = tree -> next;
-        tree -> next = legos;
-        legos = tree;
+        if (tree -> what < END_FUNCTION_GUYS)
+            byeLego(tree -> link);      /* folded value; see fold() */
+        zap_str(tree -> s);
     }
 }
 
@@ -120,12 +835,13 @@ char *read_line(void)
         buf = getmem(len);
         --Mallocs;                  /* just 1, can't free easily, so no count */
     }
+    flush();                        /* let them see what they answer */
 
     while (1) {
         s = fgets(buf + offset, len - offset, stdin);
         if (!s) {
             if (ctrl_c) {           /* no big deal - let user retype */
-                printf("\n");
+                outf("\n");
                 ctrl_c = 0, offset = 0;
                 continue;
             }
@@ -142,7 +858,7 @@ char *read_line(void)
         offset = strlen(buf);
         buf = realloc(buf, len *= 2);
         if (!buf) {
-            puts("out of memory");
+            outf("out of memory\n");
             exit(1);
         }
     }
@@ -161,40 +877,63 @@ int main(int argc, char **argv)
     struct sigaction act = { 0 };
 
     forceParens = !!getenv("PARENS");
+    compact = !!getenv("COMPACT");
     noANSI = !!getenv("NOANSI");
+    tty = isatty(STDOUT_FILENO);
+    atexit(flush);
+    if (s = getenv("MAXDEPTH"))
+        max_depth = atoi(s) > 0 ? atoi(s) : max_depth;
     urandom = fopen("/dev/urandom", "rb");
     act.sa_handler = see_ctrl_c;
     if (sigaction(SIGINT, &act, NULL))
         perror("issue with sigaction");
 
-    flash('h'); printf("%s", prompt); flash('n');
+    /* Given a file, run it and quit, rather than taking commands. */
+    if (argc > 1) {
+        if (load_file(argv[1])) {
+            lego_arena = new_arena();
+            immediate(newLego(wRUN));
+            end_arena(lego_arena);
+        }
+        else if (*warning != '~') {
+            flash('e'); outf("%s: %s\n", argv[1], warning); flash('n');
+        }
+        warning = NULL;
+        goto bye;
+    }
+
+    flash('h'); outf("%s", prompt); flash('n');
     while (1) {
         warning = NULL;             /* TODO: refactor error output */
         s = read_line();
         if (!s)
             break;
+        lego_arena = new_arena();
         ok = command_line(&s, &l);
         if (warning) {
-            flash('e'); puts(warning); flash('n');
+            flash('e'); outf("%s\n", warning); flash('n');
             warning = NULL;
         }
-        if (ok) {
-            if (immediate(l)) {     /* returns true iff "free to free" */
-                byeLego(l);
-                flash('h'); printf("%s", prompt); flash('n');
-            }
+        if (ok && immediate(l)) {   /* returns true iff not a program line */
+            flash('h'); outf("%s", prompt); flash('n');
         }
+        end_arena(lego_arena);      /* unless the line went in the program */
     }
 
-    /* Clean up the free pile AFTER deleting the program. */
+bye:
+    if (getenv("MEM"))
+        mem_report();
     erase_program();
-    for (; legos; legos = l) {
-        l = legos -> next;
-        zap(legos);
-    }
+    free_vars();
+    free_runs();
+    str_space(0);
+    free_blocks();
+    free_tokens();
 
-    if (Mallocs != Frees)
-        printf("%i mallocs and %i frees.\n", Mallocs, Frees);
+    if (Mallocs != Frees || getenv("MALLOCS"))
+        outf("%i mallocs and %i frees.\n", Mallocs, Frees);
+    if (getenv("WRITES"))
+        outf("%i writes before this one.\n", writes);
     return 0;
 }
 
@@ -213,6 +952,5 @@ void flash(int style)
         case 'e': esc = "\x1b[1;31m"; break;
         case 'n': default: esc = "\x1b[m"; break;
     }
-    printf("%s", esc);
-    fflush(stdout);
+    out_str(esc);
 }